@@ -28,7 +28,13 @@
 //
 
 #include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <libgen.h>
 
 #include "common.h"
@@ -269,10 +275,7 @@ void FixLib (void)
 	// TODO? x86 version
 #endif
 	
-	char old_buf[PATH_MAX];
-	
-	strcpy(old_buf, GetFileInTempDir(old_name));
-	rename(old_buf, GetFileInTempDir("libtcc1.a"));
+	MaterializeVirtualFile(old_name, "libtcc1.a");
 }
 
 //
@@ -288,6 +291,291 @@ void MakeDirectory (const char * filename)
 //
 //
 
+struct Mutex {
+	pthread_mutex_t mutex;
+};
+
+struct Condition {
+	pthread_cond_t cond;
+};
+
+struct Thread {
+	pthread_t thread;
+	void (*func)(void * ud);
+	void * ud;
+};
+
+//
+//
+//
+
+Mutex * NewMutex (void)
+{
+	Mutex * mutex = malloc(sizeof(Mutex));
+	
+	pthread_mutex_init(&mutex->mutex, NULL);
+	
+	return mutex;
+}
+
+//
+//
+//
+
+void LockMutex (Mutex * mutex)
+{
+	pthread_mutex_lock(&mutex->mutex);
+}
+
+//
+//
+//
+
+void UnlockMutex (Mutex * mutex)
+{
+	pthread_mutex_unlock(&mutex->mutex);
+}
+
+//
+//
+//
+
+void DestroyMutex (Mutex * mutex)
+{
+	pthread_mutex_destroy(&mutex->mutex);
+	free(mutex);
+}
+
+//
+//
+//
+
+Condition * NewCondition (void)
+{
+	Condition * condition = malloc(sizeof(Condition));
+	
+	pthread_cond_init(&condition->cond, NULL);
+	
+	return condition;
+}
+
+//
+//
+//
+
+void WaitCondition (Condition * condition, Mutex * mutex)
+{
+	pthread_cond_wait(&condition->cond, &mutex->mutex);
+}
+
+//
+//
+//
+
+void BroadcastCondition (Condition * condition)
+{
+	pthread_cond_broadcast(&condition->cond);
+}
+
+//
+//
+//
+
+void DestroyCondition (Condition * condition)
+{
+	pthread_cond_destroy(&condition->cond);
+	free(condition);
+}
+
+//
+//
+//
+
+static void * ThreadBody (void * ud)
+{
+	Thread * thread = ud;
+	
+	thread->func(thread->ud);
+	
+	return NULL;
+}
+
+//
+//
+//
+
+Thread * NewThread (void (*func)(void * ud), void * ud)
+{
+	Thread * thread = malloc(sizeof(Thread));
+	
+	thread->func = func;
+	thread->ud = ud;
+	
+	if (pthread_create(&thread->thread, NULL, ThreadBody, thread) != 0)
+	{
+		free(thread);
+		
+		return NULL;
+	}
+	
+	return thread;
+}
+
+//
+//
+//
+
+void JoinThread (Thread * thread)
+{
+	pthread_join(thread->thread, NULL);
+	free(thread);
+}
+
+//
+//
+//
+
+int GetCoreCount (void)
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	return count > 0 ? (int)count : 1;
+}
+
+//
+//
+//
+
+size_t GetPageSize (void)
+{
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+//
+//
+//
+
+void * MapPages (size_t size)
+{
+	void * pages = MAP_FAILED;
+
+#ifdef MAP_JIT
+	// Under the hardened runtime (with the allow-jit entitlement), only MAP_JIT
+	// pages may become executable; without the entitlement this fails, so fall
+	// back to ordinary pages, which then work as before.
+	pages = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANON | MAP_JIT, -1, 0);
+#endif
+
+	if (MAP_FAILED == pages) pages = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	
+	return MAP_FAILED != pages ? pages : NULL;
+}
+
+//
+//
+//
+
+void AllowCodeWrites (bool allow)
+{
+#if defined(MAP_JIT) && defined(__arm64__)
+	// On Apple silicon, MAP_JIT pages are writable or executable per thread,
+	// rather than by their protections, so TinyCC may only copy code in and
+	// relocate it in between these calls.
+	if (__builtin_available(macOS 11.0, iOS 14.0, *)) pthread_jit_write_protect_np(allow ? 0 : 1);
+#else
+	(void)allow;
+#endif
+}
+
+//
+//
+//
+
+void UnmapPages (void * pages, size_t size)
+{
+	munmap(pages, size);
+}
+
+//
+//
+//
+
+typedef struct {
+	mach_vm_address_t start;
+	mach_vm_size_t size;
+	vm_prot_t protection;
+} Range;
+
+struct PageProtection {
+	int count;
+	Range ranges[1]; // variable-length
+};
+
+//
+//
+//
+
+PageProtection * SaveProtection (const void * ptr, size_t size)
+{
+	mach_vm_address_t start = (mach_vm_address_t)ptr & ~(mach_vm_address_t)(GetPageSize() - 1), end = (mach_vm_address_t)ptr + size;
+	PageProtection * pp = malloc(sizeof(PageProtection));
+	int capacity = 1;
+	
+	pp->count = 0;
+	
+	for (mach_vm_address_t addr = start; addr < end; )
+	{
+		mach_vm_address_t region = addr;
+		mach_vm_size_t region_size;
+		vm_region_basic_info_data_64_t info;
+		mach_msg_type_number_t count = VM_REGION_BASIC_INFO_COUNT_64;
+		mach_port_t object;
+		
+		if (mach_vm_region(mach_task_self(), &region, &region_size, VM_REGION_BASIC_INFO_64, (vm_region_info_t)&info, &count, &object) != KERN_SUCCESS || region >= end) break;
+		
+		// Regions may begin before the range, or go past its end, so clamp both.
+		mach_vm_address_t region_end = region + region_size;
+		
+		if (region < addr) region = addr;
+		if (region_end > end) region_end = end;
+		if (pp->count == capacity) pp = realloc(pp, sizeof(PageProtection) + (capacity *= 2) * sizeof(Range));
+		
+		Range * range = &pp->ranges[pp->count++];
+		
+		range->start = region;
+		range->size = region_end - region;
+		range->protection = info.protection;
+		
+		addr = region_end;
+	}
+	
+	return pp;
+}
+
+//
+//
+//
+
+void ApplyProtection (const PageProtection * pp)
+{
+	for (int i = 0; i < pp->count; ++i) mprotect((void *)pp->ranges[i].start, pp->ranges[i].size, pp->ranges[i].protection);
+}
+
+//
+//
+//
+
+void ResetProtection (PageProtection * pp)
+{
+	for (int i = 0; i < pp->count; ++i) mprotect((void *)pp->ranges[i].start, pp->ranges[i].size, PROT_READ | PROT_WRITE);
+	
+	free(pp);
+}
+
+//
+//
+//
+
 void SetUpPaths (lua_State * L, Paths * paths)
 {
 	char exe_path[PATH_MAX];
@@ -0,0 +1,632 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+//
+//
+//
+
+// All of TinyCC's memory goes through the one realloc hook. While a state,
+// or a job, has an arena "in use" on the current thread, allocations of up
+// to MAX_CLASS_SIZE come from size-classed free lists, else bump-allocated
+// out of large chunks; anything else goes to the system. Every block has a
+// header recording where it came from, so it can be freed or resized even
+// with some other arena, or none, in use. Freed blocks are recycled, and an
+// arena's chunks are released in bulk once its state is deleted. Large blocks
+// made while an arena is in use are still counted against it, which is how
+// a state's memory use is measured and, optionally, capped.
+//
+// While relocating, page-sized blocks (i.e. code and data) come instead from
+// the code pool; these have no header, but are recognized by address.
+
+#define HEADER_SIZE 16 // n.b. keeps blocks 16-byte aligned
+#define MIN_CLASS_SHIFT 4 // 16 bytes
+#define NUM_CLASSES 13 // up to 64 KB
+#define MAX_CLASS_SIZE ((size_t)1 << (MIN_CLASS_SHIFT + NUM_CLASSES - 1))
+#define CHUNK_SIZE (256 * 1024)
+
+//
+//
+//
+
+typedef union {
+	struct {
+		Arena * arena; // NULL if from the system on no arena's behalf
+		size_t size; // class size, if from an arena's free lists; else as requested, n.b. always larger if on an arena's behalf
+	} info;
+	unsigned char pad[HEADER_SIZE];
+} Header;
+
+typedef union Chunk {
+	struct {
+		union Chunk * next;
+		size_t used;
+	} info;
+	unsigned char pad[HEADER_SIZE];
+} Chunk;
+
+struct Arena {
+	Chunk * chunks; // current one first
+	Header * free_lists[NUM_CLASSES];
+	size_t in_use, peak, reserved;
+	size_t budget; // if non-0, the most in use before the current step is reported as failed, cf. EndArenaBudget()
+	bool exceeded;
+};
+
+//
+//
+//
+
+static THREAD_LOCAL Arena * tCurrentArena;
+
+static THREAD_LOCAL bool tWantRunMemory;
+
+static THREAD_LOCAL void * tRunMemory;
+
+static THREAD_LOCAL BlockList * tTrackedBlocks;
+
+static THREAD_LOCAL const BlockList * tKeptBlocks;
+
+static THREAD_LOCAL BlockList * tRetainedBlocks;
+
+//
+//
+//
+
+static void AddBlock (BlockList * list, void * ptr, size_t size)
+{
+	if (list->count == list->capacity)
+	{
+		list->capacity = list->capacity ? list->capacity * 2 : 4;
+		list->blocks = realloc(list->blocks, list->capacity * sizeof(void *));
+		list->sizes = realloc(list->sizes, list->capacity * sizeof(size_t));
+	}
+
+	list->blocks[list->count] = ptr;
+	list->sizes[list->count++] = size;
+}
+
+//
+//
+//
+
+static void Untrack (const void * ptr)
+{
+	// Drop blocks freed while tracking, so that only live ones remain.
+	for (int i = 0; tTrackedBlocks && i < tTrackedBlocks->count; ++i)
+	{
+		if (tTrackedBlocks->blocks[i] != ptr) continue;
+
+		int last = --tTrackedBlocks->count;
+
+		tTrackedBlocks->blocks[i] = tTrackedBlocks->blocks[last];
+		tTrackedBlocks->sizes[i] = tTrackedBlocks->sizes[last];
+
+		break;
+	}
+}
+
+//
+//
+//
+
+static bool IsKept (const void * ptr)
+{
+	for (int i = 0; i < tKeptBlocks->count; ++i)
+	{
+		if (tKeptBlocks->blocks[i] == ptr) return true;
+	}
+
+	return false;
+}
+
+//
+//
+//
+
+static int GetClass (size_t size)
+{
+	if (size > MAX_CLASS_SIZE) return -1;
+
+	int index = 0;
+
+	while (((size_t)1 << (MIN_CLASS_SHIFT + index)) < size) ++index;
+
+	return index;
+}
+
+//
+//
+//
+
+static bool IsFromSystem (const Header * header)
+{
+	return !header->info.arena || header->info.size > MAX_CLASS_SIZE;
+}
+
+//
+//
+//
+
+static void Account (Arena * arena, size_t old_size, size_t new_size)
+{
+	if (!arena) return;
+
+	// This only accounts for use; TinyCC does not check its allocations, so
+	// going over budget is noted here, and reported once the step returns.
+	arena->in_use = arena->in_use - old_size + new_size;
+
+	if (arena->budget && arena->in_use > arena->budget) arena->exceeded = true;
+	if (arena->in_use > arena->peak) arena->peak = arena->in_use;
+}
+
+//
+//
+//
+
+static Header * Bump (Arena * arena, size_t size)
+{
+	Chunk * chunk = arena->chunks;
+
+	if (!chunk || CHUNK_SIZE - chunk->info.used < size)
+	{
+		chunk = malloc(sizeof(Chunk) + CHUNK_SIZE); // n.b. any tail left in the old chunk is abandoned
+
+		if (!chunk) return NULL;
+
+		chunk->info.next = arena->chunks;
+		chunk->info.used = 0;
+
+		arena->chunks = chunk;
+		arena->reserved += CHUNK_SIZE;
+	}
+
+	Header * header = (Header *)((unsigned char *)(chunk + 1) + chunk->info.used);
+
+	chunk->info.used += size;
+
+	return header;
+}
+
+//
+//
+//
+
+static void * Allocate (Arena * arena, size_t size)
+{
+	int index = arena ? GetClass(size) : -1;
+	Header * header;
+
+	if (index < 0)
+	{
+		header = malloc(sizeof(Header) + size);
+
+		if (!header) return NULL;
+
+		Account(arena, 0, size);
+
+		header->info.arena = arena;
+		header->info.size = size;
+
+		if (arena) arena->reserved += size;
+		if (tTrackedBlocks) AddBlock(tTrackedBlocks, header + 1, size);
+	}
+
+	else
+	{
+		size_t class_size = (size_t)1 << (MIN_CLASS_SHIFT + index);
+
+		header = arena->free_lists[index];
+
+		if (header) arena->free_lists[index] = *(Header **)(header + 1);
+		else header = Bump(arena, sizeof(Header) + class_size);
+
+		if (!header) return NULL;
+
+		Account(arena, 0, class_size);
+
+		header->info.arena = arena;
+		header->info.size = class_size;
+	}
+
+	return header + 1;
+}
+
+//
+//
+//
+
+static void Release (void * ptr)
+{
+	size_t code_size = GetCodeSize(ptr);
+	Header * header = (Header *)ptr - 1; // n.b. only valid if not code
+
+	Untrack(ptr);
+
+	if (tKeptBlocks && IsKept(ptr)) AddBlock(tRetainedBlocks, ptr, code_size ? code_size : header->info.size);
+	else if (code_size) FreeCode(ptr);
+
+	else
+	{
+		Arena * arena = header->info.arena;
+
+		Account(arena, header->info.size, 0);
+
+		if (IsFromSystem(header))
+		{
+			if (arena) arena->reserved -= header->info.size;
+
+			free(header);
+		}
+
+		else
+		{
+			int index = GetClass(header->info.size);
+
+			*(Header **)(header + 1) = arena->free_lists[index];
+			arena->free_lists[index] = header;
+		}
+	}
+}
+
+//
+//
+//
+
+static void * AllocateRunMemory (size_t size)
+{
+	// Within tcc_relocate(), libtcc 0.9.28rc makes exactly one fresh request
+	// of whole pages, its run memory: every section rounded up to a page, plus
+	// one page more to align it. The window only opens on that revision, cf.
+	// BeginRunMemory(), and growing blocks never go through here; should some
+	// other request slip in, it is freed as usual, just never trimmed, since
+	// EndRunMemory() first checks that code actually landed in it.
+	size_t page_size = GetPageSize();
+
+	if (size % page_size != 0 || size < 2 * page_size) return NULL;
+
+	void * ptr = AllocateCode(size);
+
+	if (ptr)
+	{
+		tWantRunMemory = false;
+		tRunMemory = ptr;
+
+		if (tTrackedBlocks) AddBlock(tTrackedBlocks, ptr, size);
+	}
+
+	return ptr;
+}
+
+//
+//
+//
+
+static void * ArenaRealloc (void * ptr, unsigned long size)
+{
+	if (!ptr)
+	{
+		void * run_memory = size && tWantRunMemory ? AllocateRunMemory(size) : NULL;
+
+		if (run_memory) return run_memory;
+		else return size ? Allocate(tCurrentArena, size) : NULL;
+	}
+
+	if (!size)
+	{
+		Release(ptr);
+
+		return NULL;
+	}
+
+	/* ----- */
+
+	size_t code_size = GetCodeSize(ptr);
+
+	if (code_size)
+	{
+		if (size <= code_size) return ptr;
+
+		void * new_ptr = Allocate(NULL, size);
+
+		if (new_ptr)
+		{
+			memcpy(new_ptr, ptr, code_size);
+			Release(ptr);
+		}
+
+		return new_ptr;
+	}
+
+	Header * header = (Header *)ptr - 1;
+	Arena * arena = header->info.arena;
+
+	if (arena && size <= header->info.size) return ptr; // n.b. shrinking stays put
+
+	else if (IsFromSystem(header))
+	{
+		size_t old_size = header->info.size;
+
+		Header * new_header = realloc(header, sizeof(Header) + size);
+
+		if (!new_header) return NULL;
+
+		Account(arena, old_size, size);
+		Untrack(ptr); // n.b. only compares the address
+
+		new_header->info.size = size;
+
+		if (arena) arena->reserved += size - old_size;
+		if (tTrackedBlocks) AddBlock(tTrackedBlocks, new_header + 1, size);
+
+		return new_header + 1;
+	}
+
+	/* ----- */
+
+	void * new_ptr = Allocate(arena, size); // stay with the owner, whatever is in use
+
+	if (new_ptr)
+	{
+		memcpy(new_ptr, ptr, header->info.size);
+		Release(ptr);
+	}
+
+	return new_ptr;
+}
+
+//
+//
+//
+
+void InstallArenaAllocator (void)
+{
+	static bool installed;
+
+	// Installed once, for the life of the process, before any TinyCC state
+	// exists: blocks from the default allocator would have no header.
+	if (!installed)
+	{
+		InitCodePool();
+		tcc_set_realloc(ArenaRealloc);
+	}
+
+	installed = true;
+}
+
+//
+//
+//
+
+Arena * NewArena (void)
+{
+	return calloc(1, sizeof(Arena));
+}
+
+//
+//
+//
+
+void DestroyArena (Arena * arena)
+{
+	if (!arena) return;
+
+	if (tCurrentArena == arena) tCurrentArena = NULL;
+
+	while (arena->chunks)
+	{
+		Chunk * next = arena->chunks->info.next;
+
+		free(arena->chunks);
+
+		arena->chunks = next;
+	}
+
+	free(arena);
+}
+
+//
+//
+//
+
+bool BudgetArena (Arena * arena, size_t budget)
+{
+	bool exceeded = arena->exceeded;
+
+	arena->budget = budget;
+	arena->exceeded = false;
+
+	return exceeded;
+}
+
+//
+//
+//
+
+int EndArenaBudget (Arena * arena, int result, void * opaque, TCCErrorFunc * error_func)
+{
+	// Allocations never fail on account of the budget, since TinyCC would not
+	// survive that, so the step as a whole is reported as failed afterward.
+	if (BudgetArena(arena, 0))
+	{
+		error_func(opaque, "tcc: error: memory budget exceeded");
+
+		return -1;
+	}
+
+	return result;
+}
+
+//
+//
+//
+
+void GetArenaStats (const Arena * arena, ArenaStats * stats)
+{
+	stats->in_use = arena->in_use;
+	stats->peak = arena->peak;
+	stats->reserved = arena->reserved;
+}
+
+//
+//
+//
+
+Arena * UseArena (Arena * arena)
+{
+	Arena * previous = tCurrentArena;
+
+	tCurrentArena = arena;
+
+	return previous;
+}
+
+//
+//
+//
+
+// Keeping run memory past tcc_delete() leans on how libtcc 0.9.28rc (the mob
+// branch, with the one-argument tcc_relocate()) manages it: relocation puts
+// all code and data into blocks it allocates itself, there being no way to
+// supply a buffer, and deletion resets those blocks' protections and frees
+// them, each once. Other revisions get the safe path: the state is kept whole.
+#define KNOWN_TINYCC_VERSION 928
+
+//
+//
+//
+
+bool CanKeepRunMemory (void)
+{
+	return KNOWN_TINYCC_VERSION == GetTinyCCVersion();
+}
+
+//
+//
+//
+
+void TrackSystemBlocks (BlockList * list)
+{
+	tTrackedBlocks = list;
+}
+
+//
+//
+//
+
+void KeepBlocks (const BlockList * candidates, BlockList * retained)
+{
+	// Any candidate actually freed is put in the retained list instead.
+	tKeptBlocks = candidates;
+	tRetainedBlocks = retained;
+}
+
+//
+//
+//
+
+void BeginRunMemory (void)
+{
+	tWantRunMemory = CanKeepRunMemory(); // n.b. else TinyCC's own blocks are left alone
+	tRunMemory = NULL;
+
+	AllowCodeWrites(true);
+}
+
+//
+//
+//
+
+typedef struct {
+	const unsigned char * begin, * end;
+	bool found;
+} RunRange;
+
+//
+//
+//
+
+static void FindInRange (void * ctx, const char * name, const void * value)
+{
+	RunRange * range = ctx;
+
+	(void)name;
+
+	if ((const unsigned char *)value >= range->begin && (const unsigned char *)value < range->end) range->found = true;
+}
+
+//
+//
+//
+
+void EndRunMemory (TCCState * tcc, bool relocated)
+{
+	void * ptr = tRunMemory;
+
+	tWantRunMemory = false;
+	tRunMemory = NULL;
+
+	AllowCodeWrites(false);
+
+	if (!ptr || !relocated) return;
+
+	// The block is already page-aligned, so TinyCC leaves its last page alone;
+	// once some symbol confirms this is the run memory, give that page back.
+	size_t size = GetCodeSize(ptr), page_size = GetPageSize();
+	RunRange range = { ptr, (const unsigned char *)ptr + size, false };
+
+	tcc_list_symbols(tcc, &range, FindInRange);
+
+	if (!range.found) return;
+
+	TrimCode(ptr, size - page_size);
+
+	for (int i = 0; tTrackedBlocks && i < tTrackedBlocks->count; ++i)
+	{
+		if (tTrackedBlocks->blocks[i] == ptr) tTrackedBlocks->sizes[i] = size - page_size;
+	}
+}
+
+//
+//
+//
+
+void ReleaseBlock (void * ptr)
+{
+	Release(ptr);
+}
+
+//
+//
+//
+
+void FreeBlockList (BlockList * list)
+{
+	free(list->blocks);
+	free(list->sizes);
+
+	memset(list, 0, sizeof(BlockList));
+}
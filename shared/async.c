@@ -0,0 +1,378 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+//
+//
+//
+
+#define MAX_ASYNC_WORKERS 16 // n.b. these also run the scheduler's tasks, cf. scheduler.c
+
+//
+//
+//
+
+static struct {
+	Mutex * mutex;
+	Condition * changed; // a job was queued, started, or finished
+	AsyncJob * queued, * finished;
+	int next_id;
+} sAsync;
+
+//
+//
+//
+
+static void Append (AsyncJob ** list, AsyncJob * job)
+{
+	while (*list) list = &(*list)->next;
+
+	job->next = NULL;
+	*list = job;
+}
+
+//
+//
+//
+
+static AsyncJob * TakeJob (void)
+{
+	// Jobs on a given state must run one at a time and in order, so only the
+	// oldest queued job of each idle state is a candidate; jobs on no state,
+	// e.g. kernels, always are. The candidate with the highest priority wins;
+	// the list is in submission order, so ties go to the oldest.
+	AsyncJob ** best = NULL;
+
+	for (AsyncJob ** pjob = &sAsync.queued; *pjob; pjob = &(*pjob)->next)
+	{
+		AsyncJob * job = *pjob;
+
+		if (!job->box)
+		{
+			if (!best || job->priority > (*best)->priority) best = pjob;
+
+			continue;
+		}
+
+		if (job->box->busy) continue;
+
+		bool is_oldest = true;
+
+		for (AsyncJob * prev = sAsync.queued; prev != job && is_oldest; prev = prev->next) is_oldest = prev->box != job->box;
+
+		if (is_oldest && (!best || job->priority > (*best)->priority)) best = pjob;
+	}
+
+	if (!best) return NULL;
+
+	AsyncJob * job = *best;
+
+	*best = job->next;
+
+	return job;
+}
+
+//
+//
+//
+
+static void Worker (void * ud)
+{
+	EnterScheduler((int)(size_t)ud);
+	LockMutex(sAsync.mutex);
+
+	for (;;)
+	{
+		AsyncJob * job = TakeJob();
+
+		// With no job to do, help with any scheduler tasks. These are checked
+		// for while holding the lock, and pushing one wakes the workers, cf.
+		// WakeAsyncWorkers(), so none is missed before waiting.
+		if (!job)
+		{
+			if (HasSchedulerTasks())
+			{
+				UnlockMutex(sAsync.mutex);
+				HelpScheduler();
+				LockMutex(sAsync.mutex);
+			}
+
+			else WaitCondition(sAsync.changed, sAsync.mutex);
+
+			continue;
+		}
+
+		if (job->box) job->box->busy = true;
+
+		UnlockMutex(sAsync.mutex);
+
+		job->result = job->run(job);
+
+		LockMutex(sAsync.mutex);
+
+		if (job->box) job->box->busy = false;
+
+		Append(&sAsync.finished, job);
+		BroadcastCondition(sAsync.changed); // wake anybody waiting on this state
+	}
+}
+
+//
+//
+//
+
+int CountAsyncWorkers (void)
+{
+	// One core is left for the main thread.
+	int nworkers = GetCoreCount() - 1;
+
+	if (nworkers > MAX_ASYNC_WORKERS) nworkers = MAX_ASYNC_WORKERS;
+	if (nworkers < 1) nworkers = 1;
+
+	return nworkers;
+}
+
+//
+//
+//
+
+void StartAsyncWorkers (void)
+{
+	// The pool is made on the main thread, along with the first state, and
+	// lives as long as the process, e.g. across relaunches.
+	if (sAsync.mutex) return;
+
+	sAsync.mutex = NewMutex();
+	sAsync.changed = NewCondition();
+
+	int nworkers = CountAsyncWorkers();
+
+	for (int i = 0; i < nworkers; ++i) NewThread(Worker, (void *)(size_t)(i + 1)); // n.b. never joined; 0 is the main thread's deque
+}
+
+//
+//
+//
+
+void WakeAsyncWorkers (void)
+{
+	if (!sAsync.mutex) return;
+
+	LockMutex(sAsync.mutex);
+	BroadcastCondition(sAsync.changed);
+	UnlockMutex(sAsync.mutex);
+}
+
+//
+//
+//
+
+int SubmitJob (AsyncJob * job)
+{
+	StartAsyncWorkers();
+
+	LockMutex(sAsync.mutex);
+
+	job->id = ++sAsync.next_id;
+
+	Append(&sAsync.queued, job);
+	BroadcastCondition(sAsync.changed);
+	UnlockMutex(sAsync.mutex);
+
+	if (job->box) ++job->box->pending; // n.b. main thread only, until the job is delivered
+
+	return job->id;
+}
+
+//
+//
+//
+
+int CancelJobs (const Box * box, int id)
+{
+	if (!sAsync.mutex) return 0;
+
+	// Only jobs yet to start can be cancelled; these are finished as they
+	// are, so that their callbacks still get delivered.
+	int count = 0;
+
+	LockMutex(sAsync.mutex);
+
+	for (AsyncJob ** pjob = &sAsync.queued; *pjob; )
+	{
+		AsyncJob * job = *pjob;
+
+		if (job->box == box && (0 == id || job->id == id))
+		{
+			*pjob = job->next;
+			job->cancelled = true;
+
+			Append(&sAsync.finished, job);
+
+			++count;
+		}
+
+		else pjob = &job->next;
+	}
+
+	UnlockMutex(sAsync.mutex);
+
+	return count;
+}
+
+//
+//
+//
+
+static void Purge (AsyncJob ** list, const Box * box)
+{
+	while (*list)
+	{
+		AsyncJob * job = *list;
+
+		if (job->box == box)
+		{
+			*list = job->next;
+
+			FreeJob(job);
+		}
+
+		else list = &job->next;
+	}
+}
+
+//
+//
+//
+
+void AbandonJobs (const Box * box)
+{
+	if (!sAsync.mutex) return;
+
+	// The state is going away, e.g. on relaunch, so its callbacks will never
+	// run: drop any queued work, wait out any running job, then drop that too.
+	LockMutex(sAsync.mutex);
+
+	Purge(&sAsync.queued, box);
+
+	while (box->busy) WaitCondition(sAsync.changed, sAsync.mutex);
+
+	Purge(&sAsync.finished, box);
+	UnlockMutex(sAsync.mutex);
+}
+
+//
+//
+//
+
+static bool Remove (AsyncJob ** list, const AsyncJob * job)
+{
+	for (; *list; list = &(*list)->next)
+	{
+		if (*list == job)
+		{
+			*list = job->next;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//
+//
+//
+
+void AwaitJob (AsyncJob * job, bool cancel)
+{
+	// Take the job out of circulation, once finished, so that the caller may
+	// deliver it right away; if cancelling, a job yet to start is just taken.
+	LockMutex(sAsync.mutex);
+
+	if (cancel && Remove(&sAsync.queued, job)) job->cancelled = true;
+
+	else
+	{
+		while (!Remove(&sAsync.finished, job)) WaitCondition(sAsync.changed, sAsync.mutex);
+	}
+
+	UnlockMutex(sAsync.mutex);
+}
+
+//
+//
+//
+
+int CountFinishedJobs (void)
+{
+	if (!sAsync.mutex) return 0;
+
+	int count = 0;
+
+	LockMutex(sAsync.mutex);
+
+	for (AsyncJob * job = sAsync.finished; job; job = job->next) ++count;
+
+	UnlockMutex(sAsync.mutex);
+
+	return count;
+}
+
+//
+//
+//
+
+AsyncJob * TakeFinishedJob (void)
+{
+	if (!sAsync.mutex) return NULL;
+
+	// Jobs are taken one at a time, rather than the whole list at once, since
+	// a callback may wait on a job further along, cf. AwaitJob(), which must
+	// then still be able to find it.
+	LockMutex(sAsync.mutex);
+
+	AsyncJob * job = sAsync.finished;
+
+	if (job) sAsync.finished = job->next;
+
+	UnlockMutex(sAsync.mutex);
+
+	return job;
+}
+
+//
+//
+//
+
+void FreeJob (AsyncJob * job)
+{
+	free(job->arg);
+	free(job->ud);
+	FreeDiagnostics(&job->diagnostics);
+	free(job);
+}
@@ -0,0 +1,437 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+//
+//
+//
+
+// Buffers are typed arrays of numbers, kept in userdata, whose contents
+// are a plain C array compiled code can use in place. The elements of an
+// owning buffer follow its header, suitably aligned, and so never move; a
+// slice points into its parent, which its environment keeps alive.
+
+#define BUFFER_METATABLE_NAME "solar2c.buffer"
+#define BUFFER_ALIGNMENT 64 // n.b. cache line, and ample for SIMD
+
+//
+//
+//
+
+typedef enum { INT8, UINT8, INT16, UINT16, INT32, UINT32, INT64, UINT64, FLOAT32, FLOAT64 } Kind;
+
+struct BufferType {
+	const char * name;
+	const char * ctype; // as the compiled code sees it
+	size_t size;
+	Kind kind;
+};
+
+//
+//
+//
+
+static const BufferType sBufferTypes[] = {
+	{ "int8", "signed char", 1, INT8 },
+	{ "uint8", "unsigned char", 1, UINT8 },
+	{ "int16", "short", 2, INT16 },
+	{ "uint16", "unsigned short", 2, UINT16 },
+	{ "int32", "int", 4, INT32 },
+	{ "uint32", "unsigned int", 4, UINT32 },
+	{ "int64", "long long", 8, INT64 },
+	{ "uint64", "unsigned long long", 8, UINT64 },
+	{ "float32", "float", 4, FLOAT32 },
+	{ "float64", "double", 8, FLOAT64 },
+	{ NULL, NULL, 0, INT8 }
+};
+
+//
+//
+//
+
+static lua_Number GetElement (const Buffer * buffer, size_t i)
+{
+	switch (buffer->type->kind)
+	{
+	case INT8: return ((const int8_t *)buffer->data)[i];
+	case UINT8: return ((const uint8_t *)buffer->data)[i];
+	case INT16: return ((const int16_t *)buffer->data)[i];
+	case UINT16: return ((const uint16_t *)buffer->data)[i];
+	case INT32: return ((const int32_t *)buffer->data)[i];
+	case UINT32: return ((const uint32_t *)buffer->data)[i];
+	case INT64: return (lua_Number)((const int64_t *)buffer->data)[i];
+	case UINT64: return (lua_Number)((const uint64_t *)buffer->data)[i];
+	case FLOAT32: return ((const float *)buffer->data)[i];
+	default: return ((const double *)buffer->data)[i];
+	}
+}
+
+//
+//
+//
+
+static void SetElement (Buffer * buffer, size_t i, lua_Number value)
+{
+	switch (buffer->type->kind)
+	{
+	case INT8: ((int8_t *)buffer->data)[i] = (int8_t)value; break;
+	case UINT8: ((uint8_t *)buffer->data)[i] = (uint8_t)value; break;
+	case INT16: ((int16_t *)buffer->data)[i] = (int16_t)value; break;
+	case UINT16: ((uint16_t *)buffer->data)[i] = (uint16_t)value; break;
+	case INT32: ((int32_t *)buffer->data)[i] = (int32_t)value; break;
+	case UINT32: ((uint32_t *)buffer->data)[i] = (uint32_t)value; break;
+	case INT64: ((int64_t *)buffer->data)[i] = (int64_t)value; break;
+	case UINT64: ((uint64_t *)buffer->data)[i] = (uint64_t)value; break;
+	case FLOAT32: ((float *)buffer->data)[i] = (float)value; break;
+	default: ((double *)buffer->data)[i] = value;
+	}
+}
+
+//
+//
+//
+
+Buffer * ToBuffer (lua_State * L, int index)
+{
+	Buffer * buffer = lua_touserdata(L, index);
+
+	if (!buffer || !lua_getmetatable(L, index)) return NULL; // ..., mt?
+
+	luaL_getmetatable(L, BUFFER_METATABLE_NAME); // ..., mt, buffer_mt
+
+	bool is_buffer = lua_rawequal(L, -2, -1);
+
+	lua_pop(L, 2); // ...
+
+	return is_buffer ? buffer : NULL;
+}
+
+//
+//
+//
+
+void * ToPointer (lua_State * L, int index)
+{
+	Buffer * buffer = ToBuffer(L, index);
+
+	return buffer ? buffer->data : lua_touserdata(L, index);
+}
+
+//
+//
+//
+
+static Buffer * CheckBuffer (lua_State * L, int index)
+{
+	return luaL_checkudata(L, index, BUFFER_METATABLE_NAME);
+}
+
+//
+//
+//
+
+static size_t CheckIndex (lua_State * L, const Buffer * buffer, int arg, size_t extra)
+{
+	lua_Number index = luaL_checknumber(L, arg);
+
+	luaL_argcheck(L, index >= 1 && index <= (lua_Number)(buffer->count + extra) && index == (lua_Number)(size_t)index, arg, "Index out of range");
+
+	return (size_t)index - 1;
+}
+
+//
+//
+//
+
+static Buffer * NewBuffer (lua_State * L, const BufferType * type, size_t count)
+{
+	Buffer * buffer = lua_newuserdata(L, sizeof(Buffer) + BUFFER_ALIGNMENT - 1 + count * type->size); // ..., buffer
+	uintptr_t data = ((uintptr_t)(buffer + 1) + BUFFER_ALIGNMENT - 1) & ~(uintptr_t)(BUFFER_ALIGNMENT - 1);
+
+	buffer->data = (void *)data;
+	buffer->count = count;
+	buffer->type = type;
+
+	memset(buffer->data, 0, count * type->size);
+
+	luaL_getmetatable(L, BUFFER_METATABLE_NAME); // ..., buffer, mt
+	lua_setmetatable(L, -2); // ..., buffer; buffer.metatable = mt
+
+	return buffer;
+}
+
+//
+//
+//
+
+static void SetFromTable (lua_State * L, Buffer * buffer, int t, size_t offset)
+{
+	size_t n = lua_objlen(L, t);
+
+	luaL_argcheck(L, offset + n <= buffer->count, t, "Too many elements");
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		lua_rawgeti(L, t, (int)i + 1); // ..., v
+
+		lua_Number v = lua_tonumber(L, -1);
+
+		if (0 == v && !lua_isnumber(L, -1)) luaL_argerror(L, t, lua_pushfstring(L, "Element %d is not a number", (int)i + 1)); // n.b. as per luaL_checknumber()
+
+		SetElement(buffer, offset + i, v);
+		lua_pop(L, 1); // ...
+	}
+}
+
+//
+//
+//
+
+static int Index (lua_State * L)
+{
+	Buffer * buffer = lua_touserdata(L, 1); // n.b. only reached through the metatable
+
+	if (LUA_TNUMBER == lua_type(L, 2))
+	{
+		lua_Number index = lua_tonumber(L, 2);
+
+		luaL_argcheck(L, index == floor(index), 2, "Index must be an integer"); // n.b. as with NewIndex(), rather than truncating
+
+		if (index >= 1 && index <= (lua_Number)buffer->count) lua_pushnumber(L, GetElement(buffer, (size_t)index - 1)); // buffer, index, value
+		else lua_pushnil(L); // buffer, index, nil
+
+		return 1;
+	}
+
+	lua_pushvalue(L, 2); // buffer, key, key
+	lua_rawget(L, lua_upvalueindex(1)); // buffer, key, method?
+
+	return 1;
+}
+
+//
+//
+//
+
+static int NewIndex (lua_State * L)
+{
+	Buffer * buffer = lua_touserdata(L, 1);
+	size_t index = CheckIndex(L, buffer, 2, 0);
+
+	SetElement(buffer, index, luaL_checknumber(L, 3));
+
+	return 0;
+}
+
+//
+//
+//
+
+static int Len (lua_State * L)
+{
+	lua_pushnumber(L, (lua_Number)CheckBuffer(L, 1)->count); // buffer, count
+
+	return 1;
+}
+
+//
+//
+//
+
+static int Pointer (lua_State * L)
+{
+	lua_pushlightuserdata(L, CheckBuffer(L, 1)->data); // buffer, pointer
+
+	return 1;
+}
+
+//
+//
+//
+
+static int Type (lua_State * L)
+{
+	lua_pushstring(L, CheckBuffer(L, 1)->type->name); // buffer, name
+
+	return 1;
+}
+
+//
+//
+//
+
+static int Slice (lua_State * L)
+{
+	Buffer * buffer = CheckBuffer(L, 1);
+	size_t first = CheckIndex(L, buffer, 2, 1), last = lua_isnoneornil(L, 3) ? buffer->count : CheckIndex(L, buffer, 3, 0) + 1;
+
+	luaL_argcheck(L, first <= last, 3, "Slice ends before it begins");
+
+	Buffer * slice = lua_newuserdata(L, sizeof(Buffer)); // buffer, first[, last], slice
+
+	slice->data = (char *)buffer->data + first * buffer->type->size;
+	slice->count = last - first;
+	slice->type = buffer->type;
+
+	luaL_getmetatable(L, BUFFER_METATABLE_NAME); // buffer, first[, last], slice, mt
+	lua_setmetatable(L, -2); // buffer, first[, last], slice; slice.metatable = mt
+	lua_createtable(L, 1, 0); // buffer, first[, last], slice, env
+	lua_pushvalue(L, 1); // buffer, first[, last], slice, env, buffer
+	lua_rawseti(L, -2, 1); // buffer, first[, last], slice, env = { buffer }
+	lua_setfenv(L, -2); // buffer, first[, last], slice; slice.environment = env
+
+	return 1;
+}
+
+//
+//
+//
+
+static int Set (lua_State * L)
+{
+	Buffer * buffer = CheckBuffer(L, 1);
+	size_t offset = lua_isnoneornil(L, 3) ? 0 : CheckIndex(L, buffer, 3, 1);
+	Buffer * source = ToBuffer(L, 2);
+
+	if (!source)
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		SetFromTable(L, buffer, 2, offset);
+	}
+
+	else
+	{
+		luaL_argcheck(L, offset + source->count <= buffer->count, 2, "Too many elements");
+
+		if (source->type == buffer->type) memmove((char *)buffer->data + offset * buffer->type->size, source->data, source->count * source->type->size);
+
+		else
+		{
+			for (size_t i = 0; i < source->count; ++i) SetElement(buffer, offset + i, GetElement(source, i));
+		}
+	}
+
+	return 0;
+}
+
+//
+//
+//
+
+static int ToTable (lua_State * L)
+{
+	Buffer * buffer = CheckBuffer(L, 1);
+
+	lua_createtable(L, (int)buffer->count, 0); // buffer, t
+
+	for (size_t i = 0; i < buffer->count; ++i)
+	{
+		lua_pushnumber(L, GetElement(buffer, i)); // buffer, t, v
+		lua_rawseti(L, -2, (int)i + 1); // buffer, t = { ..., v }
+	}
+
+	return 1;
+}
+
+//
+//
+//
+
+static int NewBufferFunction (lua_State * L)
+{
+	const char * name = luaL_checkstring(L, 1);
+	const BufferType * type = sBufferTypes;
+
+	while (type->name && strcmp(type->name, name) != 0) ++type;
+
+	if (!type->name) return luaL_argerror(L, 1, lua_pushfstring(L, "Unknown buffer type: %s", name));
+
+	/* ----- */
+
+	if (lua_istable(L, 2))
+	{
+		Buffer * buffer = NewBuffer(L, type, lua_objlen(L, 2)); // name, t, buffer
+
+		SetFromTable(L, buffer, 2, 0);
+	}
+
+	else
+	{
+		lua_Number count = luaL_checknumber(L, 2);
+
+		// n.b. also rejects NaN; strict, as the limit might round up when converted
+		luaL_argcheck(L, count >= 0 && count < (lua_Number)((SIZE_MAX - sizeof(Buffer) - BUFFER_ALIGNMENT) / type->size), 2, "Invalid size");
+
+		NewBuffer(L, type, (size_t)count); // name, count, buffer
+	}
+
+	return 1;
+}
+
+//
+//
+//
+
+const char * GetBufferCType (const Buffer * buffer)
+{
+	return buffer->type->ctype;
+}
+
+//
+//
+//
+
+static const struct luaL_reg buffer_methods[] = {
+	{"pointer", Pointer},
+	{"set", Set},
+	{"slice", Slice},
+	{"totable", ToTable},
+	{"type", Type},
+	{NULL, NULL}
+};
+
+//
+//
+//
+
+void AddBufferFunction (lua_State * L)
+{
+	luaL_newmetatable(L, BUFFER_METATABLE_NAME); // plugin, mt
+	lua_newtable(L); // plugin, mt, methods
+	luaL_register(L, NULL, buffer_methods);
+	lua_pushcclosure(L, Index, 1); // plugin, mt, Index
+	lua_setfield(L, -2, "__index"); // plugin, mt = { __index = Index }
+	lua_pushcfunction(L, NewIndex); // plugin, mt, NewIndex
+	lua_setfield(L, -2, "__newindex"); // plugin, mt = { __index, __newindex = NewIndex }
+	lua_pushcfunction(L, Len); // plugin, mt, Len
+	lua_setfield(L, -2, "__len"); // plugin, mt = { __index, __newindex, __len = Len }
+	lua_pop(L, 1); // plugin
+	lua_pushcfunction(L, NewBufferFunction); // plugin, NewBuffer
+	lua_setfield(L, -2, "buffer"); // plugin = { ..., buffer = NewBuffer }
+}
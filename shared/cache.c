@@ -0,0 +1,779 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "miniz.h"
+
+//
+//
+//
+
+#define CACHE_DIR "objcache"
+#define CACHE_VERSION 1
+
+//
+//
+//
+
+void RecordConfig (Box * box, char kind, const char * value)
+{
+	// Entries are the kind, followed by the NUL-terminated value. These
+	// are both replayed into object-compiling states and hashed as part
+	// of the cache key, so the order is preserved.
+	size_t len = strlen(value) + 1;
+
+	box->config = realloc(box->config, box->config_size + 1 + len);
+	box->config[box->config_size] = kind;
+
+	memcpy(box->config + box->config_size + 1, value, len);
+
+	box->config_size += 1 + len;
+}
+
+//
+//
+//
+
+void ApplyConfig (const Box * box, TCCState * tcc)
+{
+	for (size_t pos = 0; pos < box->config_size; )
+	{
+		const char * value = box->config + pos + 1;
+
+		switch (box->config[pos])
+		{
+		case CONFIG_DEFINE:
+			tcc_define_symbol(tcc, value, NULL); // n.b. recorded as "name=value"
+			break;
+		case CONFIG_INCLUDE:
+			tcc_add_include_path(tcc, value);
+			break;
+		case CONFIG_SYSINCLUDE:
+			tcc_add_sysinclude_path(tcc, value);
+			break;
+		}
+
+		pos += 1 + strlen(value) + 1;
+	}
+}
+
+//
+//
+//
+
+void ClearConfig (Box * box)
+{
+	free(box->config);
+
+	box->config = NULL;
+	box->config_size = 0;
+}
+
+//
+//
+//
+
+static void IgnoreErrors (void * opaque, const char * msg)
+{
+	(void)opaque;
+	(void)msg;
+}
+
+//
+//
+//
+
+static int sTinyCCVersion = -1;
+
+//
+//
+//
+
+void FindTinyCCVersion (void)
+{
+	// This is called while the plugin loads, before any worker can ask for
+	// the version; it never changes afterward, so reading it needs no lock.
+	if (sTinyCCVersion >= 0) return;
+
+	// libtcc has no version query, but the predefined macro gives us one.
+	TCCState * tcc = tcc_new();
+	int result = 0;
+
+	if (!tcc)
+	{
+		sTinyCCVersion = result;
+
+		return;
+	}
+
+	char include[PATH_MAX];
+
+	CopyFileInTempDir(include, "include");
+
+	tcc_set_error_func(tcc, NULL, IgnoreErrors);
+	tcc_set_output_type(tcc, TCC_OUTPUT_MEMORY);
+	tcc_set_options(tcc, "-nostdlib");
+	tcc_add_include_path(tcc, include);
+
+	if (0 == tcc_compile_string(tcc, "int version = __TINYC__;") && 0 == tcc_relocate(tcc))
+	{
+		const int * pversion = tcc_get_symbol(tcc, "version");
+
+		if (pversion) result = *pversion;
+	}
+
+	tcc_delete(tcc);
+
+	sTinyCCVersion = result;
+}
+
+//
+//
+//
+
+int GetTinyCCVersion (void)
+{
+	return sTinyCCVersion > 0 ? sTinyCCVersion : 0;
+}
+
+//
+//
+//
+
+typedef struct {
+	unsigned long long fnv;
+	mz_ulong crc;
+} Hash;
+
+//
+//
+//
+
+static void AddToHash (Hash * hash, const void * data, size_t size)
+{
+	const unsigned char * bytes = data;
+
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash->fnv ^= bytes[i];
+		hash->fnv *= 0x100000001b3ULL;
+	}
+
+	hash->crc = mz_crc32(hash->crc, bytes, size);
+}
+
+//
+//
+//
+
+static char * ReadWholeFile (const char * filename, size_t * size)
+{
+	FILE * fp = fopen(filename, "rb");
+
+	if (!fp) return NULL;
+
+	fseek(fp, 0, SEEK_END);
+
+	long len = ftell(fp);
+	char * contents = len >= 0 ? malloc((size_t)len + 1) : NULL;
+
+	fseek(fp, 0, SEEK_SET);
+
+	if (contents && fread(contents, 1, (size_t)len, fp) != (size_t)len)
+	{
+		free(contents);
+
+		contents = NULL;
+	}
+
+	fclose(fp);
+
+	if (contents)
+	{
+		contents[len] = '\0';
+		*size = (size_t)len;
+	}
+
+	return contents;
+}
+
+//
+//
+//
+
+static bool TryHeader (const char * dir, size_t dir_len, const char * name, char path[PATH_MAX])
+{
+	if (dir_len + 1 + strlen(name) >= PATH_MAX) return false;
+
+	memcpy(path, dir, dir_len);
+
+	path[dir_len] = '/';
+
+	strcpy(path + dir_len + 1, name);
+
+	FILE * fp = fopen(path, "rb");
+
+	if (!fp) return false;
+
+	fclose(fp);
+
+	return true;
+}
+
+//
+//
+//
+
+static bool FindHeader (const Box * box, const char * includer, const char * name, bool quoted, char path[PATH_MAX])
+{
+	// Follow TinyCC's search order: a quoted name is first looked for beside
+	// the file including it, then every name goes through -I and system paths.
+	if (quoted && includer)
+	{
+		const char * sep = strrchr(includer, '/');
+
+#ifdef WIN32
+		const char * bsep = strrchr(includer, '\\');
+
+		if (bsep > sep) sep = bsep;
+#endif
+
+		if (sep && TryHeader(includer, sep - includer, name, path)) return true;
+	}
+
+	const char kinds[] = { CONFIG_INCLUDE, CONFIG_SYSINCLUDE };
+
+	for (int i = 0; i < 2; ++i)
+	{
+		for (size_t pos = 0; pos < box->config_size; )
+		{
+			const char * value = box->config + pos + 1;
+			size_t len = strlen(value);
+
+			if (kinds[i] == box->config[pos] && TryHeader(value, len, name, path)) return true;
+
+			pos += 1 + len + 1;
+		}
+	}
+
+	return false;
+}
+
+//
+//
+//
+
+static const char * SkipToIncluded (const char * line, const char * end)
+{
+	const char * p = line;
+
+	while (p < end && (' ' == *p || '\t' == *p)) ++p;
+
+	if (p == end || *p++ != '#') return NULL;
+
+	while (p < end && (' ' == *p || '\t' == *p)) ++p;
+
+	if (end - p < 7 || strncmp(p, "include", 7) != 0) return NULL;
+
+	p += 7;
+
+	while (p < end && (' ' == *p || '\t' == *p)) ++p; // n.b. #include_next stops at the '_'
+
+	return p;
+}
+
+//
+//
+//
+
+static bool IsComputedInclude (const char * line, const char * end)
+{
+	const char * p = SkipToIncluded(line, end);
+
+	return p && p < end && '<' != *p && '"' != *p && '_' != *p && '\r' != *p && '\n' != *p;
+}
+
+//
+//
+//
+
+static bool ParseInclude (const char * line, const char * end, char name[PATH_MAX], bool * quoted)
+{
+	const char * p = SkipToIncluded(line, end);
+
+	if (!p || p == end || ('<' != *p && '"' != *p)) return false; // computed includes are left alone
+
+	char close = '<' == *p ? '>' : '"';
+	const char * start = ++p;
+
+	while (p < end && *p != close) ++p;
+
+	if (p == end || p == start || (size_t)(p - start) >= PATH_MAX) return false;
+
+	memcpy(name, start, p - start);
+
+	name[p - start] = '\0';
+	*quoted = '"' == close;
+
+	return true;
+}
+
+//
+//
+//
+
+static bool UpdateComment (const char * line, const char * end, bool in_comment)
+{
+	for (const char * p = line; p + 1 < end; ++p)
+	{
+		if (in_comment && '*' == p[0] && '/' == p[1])
+		{
+			in_comment = false;
+
+			++p;
+		}
+
+		else if (!in_comment && '/' == p[0] && '/' == p[1]) break;
+
+		else if (!in_comment && '/' == p[0] && '*' == p[1])
+		{
+			in_comment = true;
+
+			++p;
+		}
+	}
+
+	return in_comment;
+}
+
+//
+//
+//
+
+#define CACHE_MAX_HEADERS 256
+
+typedef struct {
+	const Box * box;
+	Hash * hash;
+	char * seen[CACHE_MAX_HEADERS];
+	int nseen;
+	bool complete;
+} Dependencies;
+
+//
+//
+//
+
+static void HashIncludes (Dependencies * deps, const char * contents, size_t size, const char * path)
+{
+	const char * end = contents + size;
+	bool in_comment = false;
+
+	for (const char * line = contents; deps->complete && line < end; )
+	{
+		const char * eol = memchr(line, '\n', end - line);
+		const char * next = eol ? eol + 1 : end;
+		char name[PATH_MAX], found[PATH_MAX];
+		bool quoted;
+
+		// Every header reachable from the source is hashed, whether or not an #if
+		// would skip it, so at worst an object is rebuilt needlessly. A header
+		// that isn't found on the state's paths, e.g. one of TinyCC's own, is
+		// keyed by its name alone, the TinyCC version covering the rest.
+		if (!in_comment && ParseInclude(line, next, name, &quoted))
+		{
+			if (FindHeader(deps->box, path, name, quoted, found))
+			{
+				bool seen = false;
+
+				for (int i = 0; i < deps->nseen && !seen; ++i) seen = strcmp(deps->seen[i], found) == 0;
+
+				if (!seen)
+				{
+					size_t header_size;
+					char * header = deps->nseen < CACHE_MAX_HEADERS ? ReadWholeFile(found, &header_size) : NULL;
+
+					if (header)
+					{
+						deps->seen[deps->nseen++] = strdup(found);
+
+						AddToHash(deps->hash, found, strlen(found) + 1);
+						AddToHash(deps->hash, header, header_size);
+						HashIncludes(deps, header, header_size, deps->seen[deps->nseen - 1]);
+
+						free(header);
+					}
+
+					else deps->complete = false;
+				}
+			}
+
+			else AddToHash(deps->hash, name, strlen(name) + 1);
+		}
+
+		// A computed include can't be followed without preprocessing, so such a
+		// source is never taken from the cache.
+		else if (!in_comment && IsComputedInclude(line, next)) deps->complete = false;
+
+		in_comment = UpdateComment(line, next, in_comment);
+		line = next;
+	}
+}
+
+//
+//
+//
+
+bool GetCachedObject (const Box * box, const char * source, size_t len, const char * filename, char path[PATH_MAX])
+{
+	Hash hash = { 0xcbf29ce484222325ULL, MZ_CRC32_INIT };
+	int header[] = { CACHE_VERSION, GetTinyCCVersion() };
+
+	AddToHash(&hash, header, sizeof(header));
+	AddToHash(&hash, box->config, box->config_size);
+
+	// The filename also matters to an added file, e.g. for __FILE__ and
+	// any includes relative to it.
+	if (filename) AddToHash(&hash, filename, strlen(filename) + 1);
+
+	AddToHash(&hash, source, len);
+
+	// So are the headers it pulls in, as found now.
+	Dependencies deps = { box, &hash, { NULL }, 0, true };
+
+	HashIncludes(&deps, source, len, filename);
+
+	for (int i = 0; i < deps.nseen; ++i) free(deps.seen[i]);
+
+	/* ----- */
+
+	char name[64];
+
+	snprintf(name, sizeof(name), CACHE_DIR "/%016llx%08lx.o", hash.fnv, (unsigned long)hash.crc);
+	CopyFileInTempDir(path, name);
+
+	FILE * fp = deps.complete ? fopen(path, "rb") : NULL; // n.b. else always rebuilt
+
+	if (!fp) return false;
+
+	fclose(fp);
+
+	return true;
+}
+
+//
+//
+//
+
+int CompileToObject (const Box * box, const char * source, const char * filename, const char * path, void * opaque, TCCErrorFunc * error_func)
+{
+	Arena * arena = NewArena(), * previous = UseArena(arena); // scratch for this one compile
+	TCCState * tcc = tcc_new();
+
+	if (!tcc)
+	{
+		UseArena(previous);
+		DestroyArena(arena);
+
+		return -1;
+	}
+
+	tcc_set_error_func(tcc, opaque, error_func);
+	tcc_set_output_type(tcc, TCC_OUTPUT_OBJ);
+
+	ApplyConfig(box, tcc);
+
+	/* ----- */
+
+	BudgetArena(arena, box->memory_budget);
+
+	int result = source ? tcc_compile_string(tcc, source) : tcc_add_file(tcc, filename);
+
+	result = EndArenaBudget(arena, result, opaque, error_func);
+
+	if (0 == result)
+	{
+		// Write to a unique name, then move it into place, so a reader never
+		// sees a partial object, e.g. from another simulator instance.
+		char temp[PATH_MAX + 32];
+
+		sprintf(temp, "%s.%p.tmp", path, (void *)tcc);
+
+		result = tcc_output_file(tcc, temp);
+
+		if (0 == result && rename(temp, path) != 0)
+		{
+			remove(temp); // already there, e.g. on Windows, if the same object was just made elsewhere
+		}
+	}
+
+	tcc_delete(tcc);
+	UseArena(previous);
+	DestroyArena(arena);
+
+	return result;
+}
+
+//
+//
+//
+
+void MakeCacheDirectory (void)
+{
+	char path[PATH_MAX];
+
+	CopyFileInTempDir(path, CACHE_DIR);
+	MakeDirectory(path);
+}
+
+//
+//
+//
+
+static int BuildCachedObject (const Box * box, const char * source, const char * filename, char path[PATH_MAX], void * opaque, TCCErrorFunc * error_func)
+{
+	char * contents = NULL;
+	size_t len;
+
+	if (source) len = strlen(source);
+	else
+	{
+		contents = ReadWholeFile(filename, &len);
+
+		if (!contents)
+		{
+			char msg[PATH_MAX + 32];
+
+			sprintf(msg, "can't read file %.*s", PATH_MAX, filename);
+			error_func(opaque, msg);
+
+			return -1;
+		}
+	}
+
+	/* ----- */
+
+	int result = 0;
+
+	if (!GetCachedObject(box, source ? source : contents, len, filename, path))
+	{
+		MakeCacheDirectory();
+
+		result = CompileToObject(box, source, filename, path, opaque, error_func);
+	}
+
+	free(contents);
+
+	return result;
+}
+
+//
+//
+//
+
+int CompileCached (Box * box, const char * source, const char * filename, void * opaque, TCCErrorFunc * error_func)
+{
+	char path[PATH_MAX];
+	int result = BuildCachedObject(box, source, filename, path, opaque, error_func);
+
+	return 0 == result ? tcc_add_file(box->tcc, path) : result;
+}
+
+//
+//
+//
+
+#define FLAT_DIR "flat"
+#define FLAT_HEADER "CoronaLua.h"
+#define FLAT_MAX_FILES 64
+#define FLAT_MAX_DEPTH 16
+
+//
+//
+//
+
+static mz_ulong sFlatKey;
+
+static int sFlatStatus; // 0 = not yet made; > 0 = made; < 0 = failed
+
+//
+//
+//
+
+typedef struct {
+	const Box * box;
+	FILE * fp;
+	char * seen[FLAT_MAX_FILES];
+	int nseen;
+} FlatHeader;
+
+//
+//
+//
+
+static void WriteLineMarker (FILE * fp, int line, const char * path)
+{
+	fprintf(fp, "#line %d \"", line);
+
+	for (const char * p = path; *p; ++p) fputc('\\' == *p ? '/' : *p, fp); // n.b. keep Windows paths free of escapes
+
+	fputs("\"\n", fp);
+}
+
+//
+//
+//
+
+static bool FlattenHeader (FlatHeader * flat, const char * path, int depth)
+{
+	size_t size;
+	char * contents = ReadWholeFile(path, &size);
+
+	if (!contents) return false;
+
+	WriteLineMarker(flat->fp, 1, path);
+
+	/* ----- */
+
+	const char * end = contents + size;
+	bool in_comment = false, ok = true;
+	int lineno = 1;
+
+	for (const char * line = contents; ok && line < end; ++lineno)
+	{
+		const char * eol = memchr(line, '\n', end - line);
+		const char * next = eol ? eol + 1 : end;
+		char name[PATH_MAX], found[PATH_MAX];
+		bool quoted;
+
+		// Inline each header the first time it is reached. Anything later is
+		// kept as a plain #include, and skipped by the header's own guard if
+		// the first copy was live; nothing inside an #if is decided here, so
+		// defines added to a state afterward still take effect.
+		if (!in_comment && depth < FLAT_MAX_DEPTH && flat->nseen < FLAT_MAX_FILES &&
+			ParseInclude(line, next, name, &quoted) && FindHeader(flat->box, path, name, quoted, found))
+		{
+			bool seen = false;
+
+			for (int i = 0; i < flat->nseen && !seen; ++i) seen = strcmp(flat->seen[i], found) == 0;
+
+			if (!seen)
+			{
+				flat->seen[flat->nseen++] = strdup(found);
+
+				ok = FlattenHeader(flat, found, depth + 1);
+
+				WriteLineMarker(flat->fp, lineno + 1, path);
+
+				line = next;
+
+				continue;
+			}
+		}
+
+		in_comment = UpdateComment(line, next, in_comment);
+
+		fwrite(line, 1, next - line, flat->fp);
+
+		if (!eol) fputc('\n', flat->fp);
+
+		line = next;
+	}
+
+	free(contents);
+
+	return ok;
+}
+
+//
+//
+//
+
+static bool WriteFlatHeader (const Box * box, const char * path)
+{
+	FlatHeader flat = { 0 };
+	char temp[PATH_MAX + 32], header[PATH_MAX];
+	bool ok = false;
+
+	if (!FindHeader(box, NULL, FLAT_HEADER, false, header)) return false;
+
+	flat.box = box;
+
+	sprintf(temp, "%s.%p.tmp", path, (void *)&flat);
+
+	flat.fp = fopen(temp, "wb");
+
+	if (flat.fp)
+	{
+		fputs("#pragma once\n", flat.fp);
+
+		flat.seen[flat.nseen++] = strdup(header);
+
+		ok = FlattenHeader(&flat, header, 0);
+
+		if (fclose(flat.fp) != 0) ok = false;
+
+		if (ok && rename(temp, path) != 0)
+		{
+			remove(path); // already there, e.g. on Windows
+
+			ok = rename(temp, path) == 0;
+		}
+
+		if (!ok) remove(temp);
+	}
+
+	for (int i = 0; i < flat.nseen; ++i) free(flat.seen[i]);
+
+	return ok;
+}
+
+//
+//
+//
+
+const char * PrepareFlatHeaders (const Box * box)
+{
+	static char dir[PATH_MAX];
+
+	// The flattened header is made once per process, from whatever headers a
+	// new state starts with, unless these change, e.g. via set_system_headers().
+	// Since no conditional is evaluated while flattening, defines play no part
+	// in it; by the same token, every compile still preprocesses and parses all
+	// of it, and only the searching and opening of the headers is saved.
+	mz_ulong key = mz_crc32(MZ_CRC32_INIT, (const unsigned char *)box->config, box->config_size);
+
+	if (0 == sFlatStatus || key != sFlatKey)
+	{
+		strcpy(dir, GetFileInTempDir(FLAT_DIR));
+		MakeDirectory(dir);
+
+		sFlatKey = key;
+		sFlatStatus = WriteFlatHeader(box, GetFileInTempDir(FLAT_DIR "/" FLAT_HEADER)) ? +1 : -1;
+	}
+
+	return sFlatStatus > 0 ? dir : NULL;
+}
@@ -0,0 +1,289 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+//
+//
+//
+
+// Relocated code and data are carved out of large page-mapped regions that
+// every state shares, rather than one system allocation apiece: modules
+// land side by side, instead of scattered across the heap, so far fewer
+// mappings (and TLB entries) cover a program built up of many small states.
+// Each module is a run of whole pages, since TinyCC sets protections page
+// by page; TinyCC's own alignment slack is given back, cf. TrimCode(), so
+// the next module begins on the very next page. A region counts the modules
+// it holds, and goes back to the system once the last of them is freed.
+//
+// Blocks are always page-aligned, so other pointers are ruled out without
+// taking the lock, which keeps the pool off TinyCC's usual free path.
+
+#define REGION_SIZE (2 * 1024 * 1024)
+
+//
+//
+//
+
+typedef struct Region {
+	struct Region * next;
+	unsigned char * base;
+	size_t npages;
+	uint32_t * runs; // at the first page of each module, its length in pages; else 0
+	unsigned char * used; // per page
+	int nmodules;
+} Region;
+
+//
+//
+//
+
+static struct {
+	Mutex * mutex;
+	Region * regions; // oldest first
+	size_t page_size;
+} sPool;
+
+//
+//
+//
+
+void InitCodePool (void)
+{
+	if (sPool.mutex) return;
+
+	sPool.mutex = NewMutex();
+	sPool.page_size = GetPageSize();
+}
+
+//
+//
+//
+
+static Region * NewRegion (size_t npages)
+{
+	Region * region = calloc(1, sizeof(Region));
+
+	if (!region) return NULL;
+
+	region->base = MapPages(npages * sPool.page_size);
+	region->npages = npages;
+	region->runs = calloc(npages, sizeof(uint32_t));
+	region->used = calloc(npages, 1);
+
+	if (!region->base || !region->runs || !region->used)
+	{
+		if (region->base) UnmapPages(region->base, npages * sPool.page_size);
+
+		free(region->runs);
+		free(region->used);
+		free(region);
+
+		return NULL;
+	}
+
+	/* ----- */
+
+	Region ** tail = &sPool.regions;
+
+	while (*tail) tail = &(*tail)->next;
+
+	*tail = region;
+
+	return region;
+}
+
+//
+//
+//
+
+static bool FindRun (const Region * region, size_t npages, size_t * start)
+{
+	// First fit, to keep modules packed toward the front.
+	for (size_t i = 0, count = 0; i < region->npages; ++i)
+	{
+		count = region->used[i] ? 0 : count + 1;
+
+		if (count == npages)
+		{
+			*start = i + 1 - npages;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//
+//
+//
+
+void * AllocateCode (size_t size)
+{
+	if (!sPool.mutex || !size) return NULL;
+
+	size_t npages = (size + sPool.page_size - 1) / sPool.page_size, start = 0;
+	Region * region;
+
+	LockMutex(sPool.mutex);
+
+	for (region = sPool.regions; region; region = region->next)
+	{
+		if (FindRun(region, npages, &start)) break;
+	}
+
+	if (!region)
+	{
+		size_t region_pages = REGION_SIZE / sPool.page_size;
+
+		region = NewRegion(npages > region_pages ? npages : region_pages); // n.b. oversized modules get a region to themselves
+	}
+
+	void * ptr = NULL;
+
+	if (region)
+	{
+		memset(region->used + start, 1, npages);
+
+		region->runs[start] = (uint32_t)npages;
+
+		++region->nmodules;
+
+		ptr = region->base + start * sPool.page_size;
+	}
+
+	UnlockMutex(sPool.mutex);
+
+	return ptr;
+}
+
+//
+//
+//
+
+static Region * FindRegion (const void * ptr, Region *** prev)
+{
+	Region ** link = &sPool.regions;
+
+	for (Region * region = *link; region; link = &region->next, region = *link)
+	{
+		const unsigned char * base = region->base;
+
+		if ((const unsigned char *)ptr >= base && (const unsigned char *)ptr < base + region->npages * sPool.page_size)
+		{
+			if (prev) *prev = link;
+
+			return region;
+		}
+	}
+
+	return NULL;
+}
+
+//
+//
+//
+
+size_t GetCodeSize (const void * ptr)
+{
+	if (!sPool.mutex || ((size_t)ptr & (sPool.page_size - 1)) != 0) return 0;
+
+	LockMutex(sPool.mutex);
+
+	Region * region = FindRegion(ptr, NULL);
+	size_t size = 0;
+
+	if (region) size = region->runs[((const unsigned char *)ptr - region->base) / sPool.page_size] * sPool.page_size;
+
+	UnlockMutex(sPool.mutex);
+
+	return size;
+}
+
+//
+//
+//
+
+void TrimCode (void * ptr, size_t size)
+{
+	LockMutex(sPool.mutex);
+
+	Region * region = FindRegion(ptr, NULL);
+
+	if (region)
+	{
+		size_t start = ((unsigned char *)ptr - region->base) / sPool.page_size, npages = (size + sPool.page_size - 1) / sPool.page_size;
+
+		if (npages > 0 && npages < region->runs[start])
+		{
+			memset(region->used + start + npages, 0, region->runs[start] - npages);
+
+			region->runs[start] = (uint32_t)npages;
+		}
+	}
+
+	UnlockMutex(sPool.mutex);
+}
+
+//
+//
+//
+
+bool FreeCode (void * ptr)
+{
+	if (!sPool.mutex || ((size_t)ptr & (sPool.page_size - 1)) != 0) return false;
+
+	LockMutex(sPool.mutex);
+
+	Region ** link, * region = FindRegion(ptr, &link);
+
+	if (region)
+	{
+		size_t start = ((unsigned char *)ptr - region->base) / sPool.page_size;
+
+		memset(region->used + start, 0, region->runs[start]);
+
+		region->runs[start] = 0;
+
+		// The first region is kept around once mapped, so a state coming and
+		// going doesn't map and unmap it each time.
+		if (0 == --region->nmodules && region != sPool.regions)
+		{
+			*link = region->next;
+
+			UnmapPages(region->base, region->npages * sPool.page_size);
+			free(region->runs);
+			free(region->used);
+			free(region);
+		}
+	}
+
+	UnlockMutex(sPool.mutex);
+
+	return region != NULL;
+}
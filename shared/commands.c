@@ -0,0 +1,377 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+//
+//
+//
+
+// A command buffer queues calls to compiled functions, to be made in one
+// go when flushed. Each kind of call, an "op", is registered up front: its
+// target is looked up once, and an invoker compiled for its signature, cf.
+// GetInvoker(). Pushing a call just stores the op and its arguments, one
+// slot apiece, after whatever is already queued.
+//
+// The environment keeps the ops' targets pinned, in slots 1, 2, etc., and
+// any strings or userdata queued as arguments alive until the next flush,
+// in its "refs" field.
+
+#define COMMANDS_METATABLE_NAME "solar2c.commands"
+
+//
+//
+//
+
+typedef struct {
+	void * target;
+	Invoker invoke;
+	int nargs;
+	char kinds[MAX_THUNK_ARGS + 1];
+} Op;
+
+typedef struct {
+	Op * ops;
+	int nops, ops_capacity;
+	Slot * slots; // for each call, the op index, then the arguments
+	size_t used, capacity;
+	int count; // calls queued
+	bool flushing; // n.b. calls may re-enter Lua, which must leave the queue alone until done
+} Commands;
+
+//
+//
+//
+
+static Commands * CheckCommands (lua_State * L)
+{
+	return luaL_checkudata(L, 1, COMMANDS_METATABLE_NAME);
+}
+
+//
+//
+//
+
+static Commands * CheckIdleCommands (lua_State * L)
+{
+	Commands * commands = CheckCommands(L);
+
+	if (commands->flushing) luaL_error(L, "Command buffer is being flushed");
+
+	return commands;
+}
+
+//
+//
+//
+
+static int Register (lua_State * L)
+{
+	Commands * commands = CheckIdleCommands(L);
+	const char * name = luaL_checkstring(L, 3), * signature = luaL_checkstring(L, 4);
+
+	lua_settop(L, 4); // commands, state, name, signature
+
+	void * target = GetPinnedSymbol(L, 2, name); // commands, state, name, signature, pin
+
+	/* ----- */
+
+	Diagnostics diags = { 0 };
+	char kinds[MAX_THUNK_ARGS + 1];
+	Invoker invoke = GetInvoker(signature, kinds, &diags);
+
+	if (!invoke)
+	{
+		PushErrorText(L, &diags, "can't make invoker"); // commands, state, name, signature, pin, error
+		FreeDiagnostics(&diags);
+
+		return lua_error(L);
+	}
+
+	FreeDiagnostics(&diags);
+
+	/* ----- */
+
+	if (commands->nops == commands->ops_capacity)
+	{
+		int capacity = commands->ops_capacity ? commands->ops_capacity * 2 : 8;
+		Op * ops = realloc(commands->ops, capacity * sizeof(Op));
+
+		if (!ops) return luaL_error(L, "Unable to register op: out of memory");
+
+		commands->ops = ops;
+		commands->ops_capacity = capacity;
+	}
+
+	Op * op = &commands->ops[commands->nops++];
+
+	op->target = target;
+	op->invoke = invoke;
+	op->nargs = (int)strlen(kinds);
+
+	strcpy(op->kinds, kinds);
+
+	lua_getfenv(L, 1); // commands, state, name, signature, pin, env
+	lua_insert(L, -2); // commands, state, name, signature, env, pin
+	lua_rawseti(L, -2, commands->nops); // commands, state, name, signature, env = { ..., pin }
+	lua_pushinteger(L, commands->nops); // commands, state, name, signature, env, op
+
+	return 1;
+}
+
+//
+//
+//
+
+static void Reference (lua_State * L, int arg)
+{
+	lua_getfenv(L, 1); // commands, op, ..., env
+	lua_getfield(L, -1, "refs"); // commands, op, ..., env, refs
+	lua_pushvalue(L, arg); // commands, op, ..., env, refs, arg
+	lua_rawseti(L, -2, (int)lua_objlen(L, -2) + 1); // commands, op, ..., env, refs = { ..., arg }
+	lua_pop(L, 2); // commands, op, ...
+}
+
+//
+//
+//
+
+static int Push (lua_State * L)
+{
+	Commands * commands = CheckIdleCommands(L);
+	int index = luaL_checkint(L, 2);
+
+	luaL_argcheck(L, index >= 1 && index <= commands->nops, 2, "Unknown op");
+
+	const Op * op = &commands->ops[index - 1];
+
+	if (lua_gettop(L) - 2 != op->nargs) return luaL_error(L, "Op %d expects %d arguments", index, op->nargs);
+
+	/* ----- */
+
+	size_t needed = commands->used + op->nargs + 1;
+
+	if (needed > commands->capacity)
+	{
+		size_t capacity = commands->capacity ? commands->capacity : 256;
+
+		while (capacity < needed) capacity *= 2;
+
+		Slot * slots = realloc(commands->slots, capacity * sizeof(Slot));
+
+		if (!slots) return luaL_error(L, "Unable to push call: out of memory");
+
+		commands->slots = slots;
+		commands->capacity = capacity;
+	}
+
+	Slot * slots = commands->slots + commands->used;
+
+	slots->n = index - 1;
+
+	for (int i = 0; i < op->nargs; ++i)
+	{
+		int arg = 3 + i;
+
+		if ('n' == op->kinds[i]) slots[i + 1].n = lua_isboolean(L, arg) ? lua_toboolean(L, arg) : luaL_checknumber(L, arg);
+
+		else
+		{
+			int type = lua_type(L, arg);
+
+			if (LUA_TSTRING == type) slots[i + 1].p = (void *)lua_tostring(L, arg);
+			else if (LUA_TUSERDATA == type || LUA_TLIGHTUSERDATA == type) slots[i + 1].p = ToPointer(L, arg);
+			else if (LUA_TNIL == type) slots[i + 1].p = NULL;
+			else return luaL_typerror(L, arg, "string, userdata, or nil");
+
+			if (LUA_TSTRING == type || LUA_TUSERDATA == type) Reference(L, arg); // n.b. until flushed
+		}
+	}
+
+	commands->used = needed;
+	commands->count++;
+
+	return 0;
+}
+
+//
+//
+//
+
+static void ClearRefs (lua_State * L)
+{
+	lua_getfenv(L, 1); // commands, env
+	lua_newtable(L); // commands, env, refs
+	lua_setfield(L, -2, "refs"); // commands, env = { ..., refs = refs }
+	lua_pop(L, 1); // commands
+}
+
+//
+//
+//
+
+static int RunCommands (lua_State * L)
+{
+	const Commands * commands = lua_touserdata(L, 1);
+
+	for (size_t i = 0; i < commands->used; )
+	{
+		const Op * op = &commands->ops[(int)commands->slots[i].n];
+
+		op->invoke(op->target, commands->slots + i + 1);
+
+		i += op->nargs + 1;
+	}
+
+	return 0;
+}
+
+//
+//
+//
+
+static int Flush (lua_State * L)
+{
+	Commands * commands = CheckIdleCommands(L);
+	int count = commands->count;
+
+	lua_settop(L, 1); // commands
+
+	// The calls may reach Lua, e.g. through bound callbacks, so the queue is
+	// locked against changes while they run. They may also throw: run them in
+	// a protected call, so the lock is always lifted and the queue emptied
+	// (the rest of its calls being dropped), then pass any error on.
+	commands->flushing = true;
+
+	int result = lua_cpcall(L, RunCommands, commands); // commands[, error]
+
+	commands->flushing = false;
+	commands->used = 0;
+	commands->count = 0;
+
+	ClearRefs(L);
+
+	if (result != 0) return lua_error(L);
+
+	lua_pushinteger(L, count); // commands, count
+
+	return 1;
+}
+
+//
+//
+//
+
+static int Clear (lua_State * L)
+{
+	Commands * commands = CheckIdleCommands(L);
+
+	commands->used = 0;
+	commands->count = 0;
+
+	lua_settop(L, 1); // commands
+
+	ClearRefs(L);
+
+	return 0;
+}
+
+//
+//
+//
+
+static int Len (lua_State * L)
+{
+	lua_pushinteger(L, CheckCommands(L)->count); // commands, count
+
+	return 1;
+}
+
+//
+//
+//
+
+static int GC (lua_State * L)
+{
+	Commands * commands = CheckCommands(L);
+
+	free(commands->ops);
+	free(commands->slots);
+
+	return 0;
+}
+
+//
+//
+//
+
+static const struct luaL_reg commands_methods[] = {
+	{"clear", Clear},
+	{"flush", Flush},
+	{"push", Push},
+	{"register", Register},
+	{NULL, NULL}
+};
+
+//
+//
+//
+
+static int NewCommands (lua_State * L)
+{
+	Commands * commands = lua_newuserdata(L, sizeof(Commands)); // commands
+
+	memset(commands, 0, sizeof(Commands));
+
+	if (luaL_newmetatable(L, COMMANDS_METATABLE_NAME)) // commands, mt
+	{
+		lua_pushvalue(L, -1); // commands, mt, mt
+		lua_setfield(L, -2, "__index"); // commands, mt = { __index = mt }
+		luaL_register(L, NULL, commands_methods);
+		lua_pushcfunction(L, Len); // commands, mt, Len
+		lua_setfield(L, -2, "__len"); // commands, mt = { __index, __len = Len }
+		lua_pushcfunction(L, GC); // commands, mt, GC
+		lua_setfield(L, -2, "__gc"); // commands, mt = { __index, __len, __gc = GC }
+	}
+
+	lua_setmetatable(L, -2); // commands; commands.metatable = mt
+	lua_createtable(L, 0, 1); // commands, env
+	lua_newtable(L); // commands, env, refs
+	lua_setfield(L, -2, "refs"); // commands, env = { refs = refs }
+	lua_setfenv(L, -2); // commands; commands.environment = env
+
+	return 1;
+}
+
+//
+//
+//
+
+void AddCommandsFunction (lua_State * L)
+{
+	lua_pushcfunction(L, NewCommands); // plugin, NewCommands
+	lua_setfield(L, -2, "commands"); // plugin = { ..., commands = NewCommands }
+}
@@ -22,6 +22,7 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "common.h"
 #include "miniz.h"
@@ -36,24 +37,36 @@ static int sPathForFileRef;
 //
 //
 
-int ForEachFile (lua_State * L, TCCState * tcc, int (*action) (TCCState * tcc, const char * filename), const char * what)
+int ForEachFile (lua_State * L, Box * box, int (*action) (Box * box, const char * filename), const char * what)
 {
 	luaL_argcheck(L, lua_istable(L, 2), 2, "Expected array of files");
 	lua_getfield(L, 1, "baseDir"); // tcc, list, baseDir?
 
 	int dir_index = lua_gettop(L); // ensure positive
 	
+	ClearDiagnostics(&box->diagnostics);
+	
 	for (size_t i = 1, n = lua_objlen(L, 2); i <= n; ++i)
 	{
 		lua_rawgeti(L, 2, (int)i); // tcc, list, baseDir?, name
 
 		const char * resolved = GetResolvedFilename(L, dir_index + 1, dir_index); // list, baseDir?, resolved_name
 
-		if (action(tcc, resolved)) return luaL_error(L, "failed to %s `%s`", what, resolved);
+		if (action(box, resolved))
+		{
+			LogWarnings(&box->diagnostics);
+			lua_pushfstring(L, "failed to %s `%s`: ", what, resolved); // tcc, list, baseDir?, resolved_name, message
+			PushErrorText(L, &box->diagnostics, "unknown error"); // tcc, list, baseDir?, resolved_name, message, errors
+			lua_concat(L, 2); // tcc, list, baseDir?, resolved_name, message .. errors
+			
+			return lua_error(L);
+		}
 		
 		lua_pop(L, 1); // tcc, list, baseDir?
 	}
 	
+	LogWarnings(&box->diagnostics);
+	
 	return 0;
 }
 
@@ -133,6 +146,25 @@ const char * GetFileInTempDir (const char * file)
 //
 //
 
+void CopyFileInTempDir (char path[PATH_MAX], const char * file)
+{
+	// Counterpart of GetFileInTempDir() for worker threads: the directory part
+	// is only read, while the result goes to the caller's buffer.
+	memcpy(path, tempfile_buf, tempfile_offset);
+
+#ifdef _WIN32
+	path[tempfile_offset] = '\\';
+#else
+	path[tempfile_offset] = '/';
+#endif
+
+	strcpy(path + tempfile_offset + 1, file);
+}
+
+//
+//
+//
+
 void PrepareToUnzip (lua_State * L)
 {
 	lua_getglobal(L, "system"); // ..., system
@@ -160,141 +192,140 @@ void PrepareToUnzip (lua_State * L)
 //
 //
 
-static bool ShouldIgnore (const char * filename)
+#define MANIFEST_NAME "solar2c.manifest"
+#define MANIFEST_VERSION 1
+
+//
+//
+//
+
+static void GetManifestContents (char * buf)
 {
+	// Key the manifest off the embedded archives themselves, so a
+	// rebuilt plugin with different contents invalidates the tree.
+	mz_ulong crc = mz_crc32(MZ_CRC32_INIT, tccData, tccSize);
+	unsigned long long size = tccSize;
+
 #ifdef WIN32
-	return false;
-#else
-	// Check for unrelated material introduced by the compressor on Mac.
-	const char prefix[] = "__MACOSX/";
+	crc = mz_crc32(crc, libsData, libsSize);
+	size += libsSize;
+#endif
 	
-	return strncmp(filename, prefix, strlen(prefix)) == 0;
-#endif 
+	sprintf(buf, "solar2c %d %08lx %llu\n", MANIFEST_VERSION, (unsigned long)crc, size);
 }
 
 //
 //
 //
 
-#ifdef __APPLE__
-void ExtractZip(const unsigned char buf[], const size_t buf_size)
+bool IsExtractionCurrent (void)
 {
-	mz_zip_archive zip = { 0 };
+	char expected[64], actual[64] = { 0 };
 
-	if (mz_zip_reader_init_mem(&zip, buf, buf_size, 0))
-	{
-		char filename[PATH_MAX];
-
-		/* ----- */
-
-		mz_uint n = mz_zip_reader_get_num_files(&zip);
-
-		for (mz_uint i = 0; i < n; ++i)
-		{
-			if (!mz_zip_reader_is_file_a_directory(&zip, i)) continue;
-
-			mz_zip_reader_get_filename(&zip, i, filename, PATH_MAX);
-
-			MakeDirectory(GetFileInTempDir(filename));
-		}
-
-		/* ----- */
-
-		for (mz_uint i = 0; i < n; ++i)
-		{
-			mz_zip_reader_get_filename(&zip, i, filename, PATH_MAX);
-
-			if (!mz_zip_reader_is_file_a_directory(&zip, i) && !ShouldIgnore(filename))
-			{
-				mz_zip_reader_extract_to_file(&zip, i, GetFileInTempDir(filename), 0);
-			}
-		}
+	GetManifestContents(expected);
+	
+	FILE * fp = fopen(GetFileInTempDir(MANIFEST_NAME), "rb");
+	
+	if (!fp) return false;
+	
+	fread(actual, 1, sizeof(actual) - 1, fp);
+	fclose(fp);
+	
+	if (strcmp(expected, actual) != 0) return false;
+	
+	/* ----- */
+	
+	// The manifest might have outlived part of the tree, e.g. if the
+	// temporary directory was partially cleared; the renamed library
+	// is the last thing extraction produces, so make sure it exists.
+	fp = fopen(GetFileInTempDir("libtcc1.a"), "rb");
+	
+	if (!fp) return false;
+	
+	fclose(fp);
+	
+	return true;
+}
 
-		/* ----- */
+//
+//
+//
 
-		mz_zip_reader_end(&zip);
-	}
-}
-#elif WIN32
-void ExtractZip(const unsigned char buf[], const size_t size, const char* dir)
+void WriteManifest (void)
 {
-	mz_zip_archive zip = { 0 };
+	char contents[64];
 
-	if (mz_zip_reader_init_mem(&zip, buf, size, 0))
-	{
-		char filename[PATH_MAX], * pf = filename;
-		mz_uint remaining_size = PATH_MAX;
+	GetManifestContents(contents);
 
-		// Create root directory if specified
-		if (dir)
-		{
-			// Use platform-specific directory creation
-			_mkdir(GetFileInTempDir(dir));
+	FILE * fp = fopen(GetFileInTempDir(MANIFEST_NAME), "wb");
+	
+	if (!fp) return;
+	
+	fputs(contents, fp);
+	fclose(fp);
+}
 
-			strcpy(filename, dir);
-			pf += strlen(filename);
+//
+//
+//
 
-			// Use platform-specific separator
+static bool ShouldIgnore (const char * filename)
+{
+	// The runtime libraries are per-architecture; FixLib() writes out the
+	// appropriate one, under the name TinyCC expects.
+	const char lib_prefix[] = "libtcc_";
+	
+	return strncmp(filename, lib_prefix, strlen(lib_prefix)) == 0;
+}
 
-			* pf = '\\';
+//
+//
+//
 
-			++pf;
-			remaining_size -= (mz_uint)(pf - filename);
-		}
+void MountArchives (void)
+{
+	MountArchive(tccData, tccSize, NULL);
+#ifdef WIN32
+	MountArchive(libsData, libsSize, "library/");
+#endif
+}
 
-		// First pass: create directories
-		mz_uint n = mz_zip_reader_get_num_files(&zip);
-		for (mz_uint i = 0; i < n; ++i)
-		{
-			if (!mz_zip_reader_is_file_a_directory(&zip, i)) continue;
+//
+//
+//
 
-			mz_zip_reader_get_filename(&zip, i, pf, remaining_size);
+void ExtractArchives (void)
+{
+	MaterializeVirtualFiles(ShouldIgnore);
+}
 
-			// Normalize path separators if needed
-			char* p = pf;
-			while (*p) {
-				if (*p == '/') *p = '\\';
-				p++;
-			}
+//
+//
+//
 
-			// Create directory
-			_mkdir(GetFileInTempDir(filename));
-		}
+#define MAX_PARALLEL 16
 
-		// Second pass: extract files
-		for (mz_uint i = 0; i < n; ++i)
-		{
-			mz_zip_reader_get_filename(&zip, i, pf, remaining_size);
-
-			if (!mz_zip_reader_is_file_a_directory(&zip, i) && !ShouldIgnore(pf))
-			{
-				// Normalize path for Windows if needed
-
-				char* p = pf;
-				while (*p) {
-					if (*p == '/') *p = '\\';
-					p++;
-				}
-
-				const char* output_path = GetFileInTempDir(filename);
-
-				// Ensure parent directories exist (more important on Windows)
-
-				char path_copy[PATH_MAX];
-				strcpy(path_copy, output_path);
-				char* sep = path_copy;
-				while ((sep = strchr(sep, '\\'))) {
-					*sep = '\0';
-					_mkdir(path_copy);
-					*sep = '\\';
-					sep++;
-				}
-
-				mz_zip_reader_extract_to_file(&zip, i, output_path, 0);
-			}
-		}
+//
+//
+//
 
-		mz_zip_reader_end(&zip);
+void RunInParallel (int count, void (*func)(void * ud), void * ud)
+{
+	Thread * threads[MAX_PARALLEL];
+	int nthreads = 0;
+	
+	if (count > MAX_PARALLEL) count = MAX_PARALLEL;
+	
+	// The calling thread takes part too, so spawn one fewer. If spawning
+	// comes up short, whoever did start still drains the work.
+	for (int i = 1; i < count; ++i)
+	{
+		Thread * thread = NewThread(func, ud);
+		
+		if (thread) threads[nthreads++] = thread;
 	}
+	
+	func(ud);
+	
+	for (int i = 0; i < nthreads; ++i) JoinThread(threads[i]);
 }
-#endif
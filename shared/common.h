@@ -26,13 +26,24 @@
 
 #include <CoronaLua.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 
 #define INCBIN_PREFIX
 
+#ifndef INCBIN_ALIGNMENT_INDEX
+	#define INCBIN_ALIGNMENT_INDEX 12 // page-aligned, see pack.h
+#endif
+
 #include "libtcc.h"
 #include "incbin.h"
 
+#ifdef _MSC_VER
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
 #ifdef WIN32
 	#ifndef PATH_MAX
 	#  define PATH_MAX 260
@@ -50,13 +61,143 @@ INCBIN_EXTERN(tcc);
 //
 //
 
-int ForEachFile (lua_State * L, TCCState * tcc, int (*action) (TCCState * tcc, const char * filename), const char * what);
+typedef struct {
+	char * text; // as reported by TinyCC
+	char * file; // NULL if none
+	const char * message; // within text, after the location and severity
+	int line;
+	bool is_warning;
+} Diagnostic;
+
+typedef struct {
+	Diagnostic * items;
+	int count, capacity, nerrors;
+} Diagnostics;
+
+//
+//
+//
+
+void CollectDiagnostic (void * opaque, const char * msg);
+void ClearDiagnostics (Diagnostics * diags);
+void FreeDiagnostics (Diagnostics * diags);
+void LogWarnings (const Diagnostics * diags);
+void PushErrorText (lua_State * L, const Diagnostics * diags, const char * fallback);
+void PushDiagnostics (lua_State * L, const Diagnostics * diags);
+
+//
+//
+//
+
+typedef struct Arena Arena;
+
+typedef struct {
+	void ** blocks;
+	size_t * sizes;
+	int count, capacity;
+} BlockList;
+
+void InstallArenaAllocator (void);
+Arena * NewArena (void);
+void DestroyArena (Arena * arena);
+Arena * UseArena (Arena * arena);
+bool BudgetArena (Arena * arena, size_t budget);
+int EndArenaBudget (Arena * arena, int result, void * opaque, TCCErrorFunc * error_func);
+
+typedef struct {
+	size_t in_use, peak, reserved;
+} ArenaStats;
+
+void GetArenaStats (const Arena * arena, ArenaStats * stats);
+void BeginRunMemory (void);
+void EndRunMemory (TCCState * tcc, bool relocated);
+
+bool CanKeepRunMemory (void);
+void TrackSystemBlocks (BlockList * list);
+void KeepBlocks (const BlockList * candidates, BlockList * retained);
+void ReleaseBlock (void * ptr);
+void FreeBlockList (BlockList * list);
+
+//
+//
+//
+
+size_t GetPageSize (void);
+void * MapPages (size_t size);
+void UnmapPages (void * pages, size_t size);
+void AllowCodeWrites (bool allow);
+
+void InitCodePool (void);
+void * AllocateCode (size_t size);
+size_t GetCodeSize (const void * ptr);
+void TrimCode (void * ptr, size_t size);
+bool FreeCode (void * ptr);
+
+typedef struct PageProtection PageProtection;
+
+PageProtection * SaveProtection (const void * ptr, size_t size);
+void ApplyProtection (const PageProtection * pp);
+void ResetProtection (PageProtection * pp);
+
+//
+//
+//
+
+typedef struct {
+	const char * name;
+	void * value;
+} Symbol;
+
+//
+//
+//
+
+typedef struct Callback Callback;
+
+typedef struct {
+	int refs; // the state, and whatever might still call into its code; main thread only
+	BlockList blocks; // code and data kept past the compiler
+	PageProtection ** protections; // for each kept block
+	Callback * callbacks; // bound before relocation, cf. bind_callback()
+	TCCState * tcc; // if the state could not be finalized, it is kept whole instead...
+	Arena * arena; // ...along with its arena
+} Module;
+
+//
+//
+//
+
+typedef struct {
+	TCCState * tcc;
+	Arena * arena; // everything the state allocates
+	BlockList run_blocks; // from relocation, until finalizing
+	Module * module;
+	Symbol * symbols; // after finalizing, sorted by name
+	int nsymbols;
+	Diagnostics diagnostics; // from the latest operation; n.b. also the error function's opaque pointer
+	char * config; // preprocessor settings, cf. RecordConfig()
+	size_t config_size;
+	int pending; // asynchronous jobs not yet delivered; main thread only
+	bool busy; // a worker is using the state; guarded by the job mutex
+	size_t memory_budget; // if non-0, the compiler's heap use past which a step is reported as failed
+	bool use_cache;
+} Box;
+
+//
+//
+//
+
+int ForEachFile (lua_State * L, Box * box, int (*action) (Box * box, const char * filename), const char * what);
 
 const char * GetResolvedFilename (lua_State * L, int file_index, int dir_index);
 const char * GetFileInTempDir (const char * file);
+void CopyFileInTempDir (char path[PATH_MAX], const char * file);
 
 void PrepareToUnzip (lua_State * L);
-void ExtractZip (const unsigned char buf[], const size_t size);
+bool IsExtractionCurrent (void);
+void WriteManifest (void);
+void MountArchives (void);
+void ExtractArchives (void);
 void FixLib (void);
 void MakeDirectory (const char * filename);
 
@@ -64,6 +205,138 @@ void MakeDirectory (const char * filename);
 //
 //
 
+void MountArchive (const unsigned char buf[], size_t size, const char * prefix);
+bool MaterializeVirtualFile (const char * name, const char * as);
+void MaterializeVirtualFiles (bool (*should_ignore)(const char * name));
+
+//
+//
+//
+
+typedef struct Condition Condition;
+typedef struct Mutex Mutex;
+typedef struct Thread Thread;
+
+Mutex * NewMutex (void);
+void LockMutex (Mutex * mutex);
+void UnlockMutex (Mutex * mutex);
+void DestroyMutex (Mutex * mutex);
+
+Condition * NewCondition (void);
+void WaitCondition (Condition * condition, Mutex * mutex);
+void BroadcastCondition (Condition * condition);
+void DestroyCondition (Condition * condition);
+
+Thread * NewThread (void (*func)(void * ud), void * ud);
+void JoinThread (Thread * thread);
+
+int GetCoreCount (void);
+void RunInParallel (int count, void (*func)(void * ud), void * ud);
+
+//
+//
+//
+
+#define CONFIG_DEFINE 'D'
+#define CONFIG_INCLUDE 'I'
+#define CONFIG_SYSINCLUDE 'S'
+
+void RecordConfig (Box * box, char kind, const char * value);
+void ApplyConfig (const Box * box, TCCState * tcc);
+void ClearConfig (Box * box);
+
+void MakeCacheDirectory (void);
+bool GetCachedObject (const Box * box, const char * source, size_t len, const char * filename, char path[PATH_MAX]);
+int CompileToObject (const Box * box, const char * source, const char * filename, const char * path, void * opaque, TCCErrorFunc * error_func);
+int CompileCached (Box * box, const char * source, const char * filename, void * opaque, TCCErrorFunc * error_func);
+void FindTinyCCVersion (void);
+int GetTinyCCVersion (void);
+
+const char * PrepareFlatHeaders (const Box * box);
+
+typedef struct BufferType BufferType;
+
+typedef struct {
+	void * data;
+	size_t count;
+	const BufferType * type;
+} Buffer;
+
+Buffer * ToBuffer (lua_State * L, int index);
+void * ToPointer (lua_State * L, int index);
+const char * GetBufferCType (const Buffer * buffer);
+void AddBufferFunction (lua_State * L);
+void AddCommandsFunction (lua_State * L);
+void AddFrameHookFunction (lua_State * L);
+void PushJobsTable (lua_State * L);
+void AddSchedulerSymbols (TCCState * tcc);
+void EnterScheduler (int index);
+bool HasSchedulerTasks (void);
+void HelpScheduler (void);
+
+void * GetPinnedSymbol (lua_State * L, int arg, const char * name);
+void * GetRetainedSymbol (lua_State * L, int arg, const char * name, Module ** module);
+void ReleaseModule (Module * module);
+
+#define MAX_THUNK_ARGS 16
+
+lua_CFunction GetThunk (const char * signature, Diagnostics * diags);
+
+typedef void (*Mapper) (lua_State * L, void * target, int in, int out, int n);
+
+Mapper GetMapper (const char * signature, int * nargs, Diagnostics * diags);
+
+typedef void (*BufferMapper) (void * target, void * const * data, size_t n);
+
+BufferMapper GetBufferMapper (const char * signature, const char * const ctypes[], int nctypes, Diagnostics * diags);
+
+typedef union {
+	double n;
+	void * p;
+} Slot;
+
+typedef void (*Invoker) (void * target, const Slot * args);
+
+Invoker GetInvoker (const char * signature, char kinds[MAX_THUNK_ARGS + 1], Diagnostics * diags);
+
+Callback * NewCallback (lua_State * L, int ref, const char * signature, Callback * next, Diagnostics * diags);
+void * GetCallbackFunction (const Callback * callback);
+void FreeCallbacks (Callback * callback);
+void AddCallbackSymbols (TCCState * tcc);
+
+//
+//
+//
+
+typedef struct AsyncJob {
+	struct AsyncJob * next;
+	Box * box; // if absent, the job may run alongside any other
+	int (*run)(struct AsyncJob * job); // called on a worker thread
+	void (*deliver)(lua_State * L, struct AsyncJob * job); // if present, called on the main thread in place of on_done, and frees the job
+	char * arg; // source, filename, etc.
+	void * ud; // anything else run() needs
+	Diagnostics diagnostics;
+	int id, priority, result;
+	int state_ref, func_ref;
+	bool cancelled;
+} AsyncJob;
+
+int CountAsyncWorkers (void);
+void StartAsyncWorkers (void);
+void WakeAsyncWorkers (void);
+int SubmitJob (AsyncJob * job);
+int CancelJobs (const Box * box, int id);
+void AbandonJobs (const Box * box);
+void AwaitJob (AsyncJob * job, bool cancel);
+void EnsureDrainListener (lua_State * L);
+int CountFinishedJobs (void);
+AsyncJob * TakeFinishedJob (void);
+void FreeJob (AsyncJob * job);
+
+//
+//
+//
+
 typedef struct {
 	char Corona[PATH_MAX];
 	char Lua[PATH_MAX];
@@ -0,0 +1,224 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+//
+//
+//
+
+static char * Copy (const char * str, size_t len)
+{
+	char * copy = malloc(len + 1);
+
+	if (!copy) return NULL;
+
+	memcpy(copy, str, len);
+
+	copy[len] = '\0';
+
+	return copy;
+}
+
+//
+//
+//
+
+static const char * FindSeverity (const char * msg, bool * is_warning)
+{
+	const char * error = strstr(msg, "error: "), * warning = strstr(msg, "warning: ");
+
+	*is_warning = warning && (!error || warning < error);
+
+	return *is_warning ? warning : error;
+}
+
+//
+//
+//
+
+static void ParseLocation (Diagnostic * diag, const char * begin, const char * end)
+{
+	// The location precedes the severity as "file:line: ", or is just "tcc: "
+	// when the problem has none. Any "In file included from..." lines come
+	// first, so only the last line matters.
+	for (const char * nl = begin; (nl = memchr(nl, '\n', end - nl)); ) begin = ++nl;
+
+	while (end > begin && (':' == end[-1] || ' ' == end[-1])) --end;
+
+	const char * colon = end;
+
+	while (colon > begin && ':' != colon[-1]) --colon;
+
+	if (colon > begin && colon < end)
+	{
+		diag->file = Copy(begin, colon - 1 - begin);
+		diag->line = diag->file ? atoi(colon) : 0;
+	}
+}
+
+//
+//
+//
+
+void CollectDiagnostic (void * opaque, const char * msg)
+{
+	Diagnostics * diags = opaque;
+	bool is_warning;
+	const char * severity = FindSeverity(msg, &is_warning);
+
+	// Errors are counted even if memory runs short, and the diagnostic itself
+	// has to be dropped.
+	if (!is_warning) ++diags->nerrors;
+
+	if (diags->count == diags->capacity)
+	{
+		int capacity = diags->capacity ? diags->capacity * 2 : 8;
+		Diagnostic * items = realloc(diags->items, capacity * sizeof(Diagnostic));
+
+		if (!items) return;
+
+		diags->items = items;
+		diags->capacity = capacity;
+	}
+
+	char * text = Copy(msg, strlen(msg));
+
+	if (!text) return;
+
+	/* ----- */
+
+	Diagnostic * diag = &diags->items[diags->count++];
+
+	diag->text = text;
+	diag->file = NULL;
+	diag->line = 0;
+	diag->message = diag->text;
+	diag->is_warning = is_warning;
+
+	if (severity)
+	{
+		ParseLocation(diag, msg, severity);
+
+		diag->message += (severity - msg) + (is_warning ? sizeof("warning: ") : sizeof("error: ")) - 1;
+	}
+}
+
+//
+//
+//
+
+void ClearDiagnostics (Diagnostics * diags)
+{
+	for (int i = 0; i < diags->count; ++i)
+	{
+		free(diags->items[i].text);
+		free(diags->items[i].file);
+	}
+
+	diags->count = diags->nerrors = 0; // n.b. capacity kept for reuse
+}
+
+//
+//
+//
+
+void FreeDiagnostics (Diagnostics * diags)
+{
+	ClearDiagnostics(diags);
+	free(diags->items);
+
+	diags->items = NULL;
+	diags->capacity = 0;
+}
+
+//
+//
+//
+
+void LogWarnings (const Diagnostics * diags)
+{
+	for (int i = 0; i < diags->count; ++i)
+	{
+		if (diags->items[i].is_warning) CoronaLog("WARNING: %s", diags->items[i].text);
+	}
+}
+
+//
+//
+//
+
+void PushErrorText (lua_State * L, const Diagnostics * diags, const char * fallback)
+{
+	luaL_Buffer buffer;
+	bool any = false;
+
+	luaL_buffinit(L, &buffer);
+
+	for (int i = 0; i < diags->count; ++i)
+	{
+		if (diags->items[i].is_warning) continue;
+		if (any) luaL_addchar(&buffer, '\n');
+
+		luaL_addstring(&buffer, diags->items[i].text);
+
+		any = true;
+	}
+
+	if (!any) luaL_addstring(&buffer, fallback);
+
+	luaL_pushresult(&buffer); // ..., text
+}
+
+//
+//
+//
+
+void PushDiagnostics (lua_State * L, const Diagnostics * diags)
+{
+	lua_createtable(L, diags->count, 0); // ..., list
+
+	for (int i = 0; i < diags->count; ++i)
+	{
+		const Diagnostic * diag = &diags->items[i];
+
+		lua_createtable(L, 0, 4); // ..., list, entry
+
+		if (diag->file)
+		{
+			lua_pushstring(L, diag->file); // ..., list, entry, file
+			lua_setfield(L, -2, "file"); // ..., list, entry = { file = file }
+			lua_pushinteger(L, diag->line); // ..., list, entry, line
+			lua_setfield(L, -2, "line"); // ..., list, entry = { file, line = line }
+		}
+
+		lua_pushstring(L, diag->is_warning ? "warning" : "error"); // ..., list, entry, severity
+		lua_setfield(L, -2, "severity"); // ..., list, entry = { file?, line?, severity = severity }
+		lua_pushstring(L, diag->message); // ..., list, entry, message
+		lua_setfield(L, -2, "message"); // ..., list, entry = { file?, line?, severity, message = message }
+		lua_rawseti(L, -2, i + 1); // ..., list = { ..., entry }
+	}
+}
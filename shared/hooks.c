@@ -0,0 +1,201 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+
+#include "common.h"
+
+//
+//
+//
+
+// Frame hooks are compiled functions run once per frame, in the order they
+// were added, from a single enterFrame listener; thus no Lua is involved
+// per hook. Each hook's node lives in its handle, and the list links these
+// together, so removal is just an unlink.
+//
+// The list's environment keeps every handle alive until removed; in turn, a
+// handle's keeps the hook's pin and any userdata passed along.
+
+#define HOOK_METATABLE_NAME "solar2c.hook"
+
+//
+//
+//
+
+typedef void (*FrameHook) (void * userdata);
+
+typedef struct Hook {
+	struct Hook * prev, * next;
+	FrameHook func;
+	void * userdata;
+	bool linked;
+} Hook;
+
+typedef struct {
+	Hook * head, * tail;
+	bool listening;
+} HookList;
+
+//
+//
+//
+
+static int RunHooks (lua_State * L)
+{
+	HookList * list = lua_touserdata(L, lua_upvalueindex(1));
+
+	for (Hook * hook = list->head; hook; hook = hook->next) hook->func(hook->userdata);
+
+	return 0;
+}
+
+//
+//
+//
+
+static void Listen (lua_State * L, HookList * list)
+{
+	if (list->listening) return;
+
+	lua_getglobal(L, "Runtime"); // ..., Runtime
+	lua_getfield(L, -1, "addEventListener"); // ..., Runtime, Runtime.addEventListener
+	lua_insert(L, -2); // ..., Runtime.addEventListener, Runtime
+	lua_pushliteral(L, "enterFrame"); // ..., Runtime.addEventListener, Runtime, "enterFrame"
+	lua_pushvalue(L, lua_upvalueindex(1)); // ..., Runtime.addEventListener, Runtime, "enterFrame", list
+	lua_pushcclosure(L, RunHooks, 1); // ..., Runtime.addEventListener, Runtime, "enterFrame", RunHooks
+	lua_call(L, 3, 0); // ...
+
+	list->listening = true;
+}
+
+//
+//
+//
+
+static int Remove (lua_State * L)
+{
+	Hook * hook = luaL_checkudata(L, 1, HOOK_METATABLE_NAME);
+
+	lua_pushboolean(L, hook->linked); // hook, linked
+
+	if (!hook->linked) return 1;
+
+	/* ----- */
+
+	lua_getfenv(L, 1); // hook, true, env
+	lua_rawgeti(L, -1, 1); // hook, true, env, list
+
+	HookList * list = lua_touserdata(L, -1);
+
+	if (hook->prev) hook->prev->next = hook->next;
+	else list->head = hook->next;
+
+	if (hook->next) hook->next->prev = hook->prev;
+	else list->tail = hook->prev;
+
+	hook->linked = false;
+
+	lua_getfenv(L, -1); // hook, true, env, list, handles
+	lua_pushvalue(L, 1); // hook, true, env, list, handles, hook
+	lua_pushnil(L); // hook, true, env, list, handles, hook, nil
+	lua_rawset(L, -3); // hook, true, env, list, handles = { ..., [hook] = nil }
+	lua_pop(L, 3); // hook, true
+
+	return 1;
+}
+
+//
+//
+//
+
+static int AddFrameHook (lua_State * L)
+{
+	const char * name = luaL_checkstring(L, 2);
+	int type = lua_type(L, 3);
+
+	luaL_argcheck(L, LUA_TNONE == type || LUA_TNIL == type || LUA_TLIGHTUSERDATA == type || LUA_TUSERDATA == type, 3, "Expected userdata");
+	lua_settop(L, 3); // state, name, userdata?
+
+	FrameHook func = (FrameHook)GetPinnedSymbol(L, 1, name); // state, name, userdata?, pin
+	HookList * list = lua_touserdata(L, lua_upvalueindex(1));
+	Hook * hook = lua_newuserdata(L, sizeof(Hook)); // state, name, userdata?, pin, hook
+
+	hook->func = func;
+	hook->userdata = ToPointer(L, 3); // n.b. buffers give their contents
+	hook->prev = list->tail;
+	hook->next = NULL;
+	hook->linked = true;
+
+	if (luaL_newmetatable(L, HOOK_METATABLE_NAME)) // state, name, userdata?, pin, hook, mt
+	{
+		lua_pushvalue(L, -1); // state, name, userdata?, pin, hook, mt, mt
+		lua_setfield(L, -2, "__index"); // state, name, userdata?, pin, hook, mt = { __index = mt }
+		lua_pushcfunction(L, Remove); // state, name, userdata?, pin, hook, mt, Remove
+		lua_setfield(L, -2, "remove"); // state, name, userdata?, pin, hook, mt = { __index, remove = Remove }
+	}
+
+	lua_setmetatable(L, -2); // state, name, userdata?, pin, hook; hook.metatable = mt
+	lua_createtable(L, 3, 0); // state, name, userdata?, pin, hook, env
+	lua_pushvalue(L, lua_upvalueindex(1)); // state, name, userdata?, pin, hook, env, list
+	lua_rawseti(L, -2, 1); // state, name, userdata?, pin, hook, env = { list }
+	lua_pushvalue(L, 4); // state, name, userdata?, pin, hook, env, pin
+	lua_rawseti(L, -2, 2); // state, name, userdata?, pin, hook, env = { list, pin }
+	lua_pushvalue(L, 3); // state, name, userdata?, pin, hook, env, userdata?
+	lua_rawseti(L, -2, 3); // state, name, userdata?, pin, hook, env = { list, pin, userdata? }
+	lua_setfenv(L, -2); // state, name, userdata?, pin, hook; hook.environment = env
+
+	/* ----- */
+
+	lua_getfenv(L, lua_upvalueindex(1)); // state, name, userdata?, pin, hook, handles
+	lua_pushvalue(L, -2); // state, name, userdata?, pin, hook, handles, hook
+	lua_pushboolean(L, 1); // state, name, userdata?, pin, hook, handles, hook, true
+	lua_rawset(L, -3); // state, name, userdata?, pin, hook, handles = { ..., [hook] = true }
+	lua_pop(L, 1); // state, name, userdata?, pin, hook
+
+	if (list->tail) list->tail->next = hook;
+	else list->head = hook;
+
+	list->tail = hook;
+
+	Listen(L, list);
+
+	return 1;
+}
+
+//
+//
+//
+
+void AddFrameHookFunction (lua_State * L)
+{
+	// The list belongs to this Lua state, so a relaunch starts over with a new one.
+	HookList * list = lua_newuserdata(L, sizeof(HookList)); // plugin, list
+
+	list->head = list->tail = NULL;
+	list->listening = false;
+
+	lua_newtable(L); // plugin, list, handles
+	lua_setfenv(L, -2); // plugin, list; list.environment = handles
+	lua_pushcclosure(L, AddFrameHook, 1); // plugin, AddFrameHook
+	lua_setfield(L, -2, "add_frame_hook"); // plugin = { ..., add_frame_hook = AddFrameHook }
+}
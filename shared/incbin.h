@@ -9,7 +9,9 @@
 #ifndef INCBIN_HDR
 #define INCBIN_HDR
 #include <limits.h>
-#if   defined(__AVX512BW__) || \
+#if defined(INCBIN_ALIGNMENT_INDEX)
+/* User-specified alignment */
+#elif defined(__AVX512BW__) || \
       defined(__AVX512CD__) || \
       defined(__AVX512DQ__) || \
       defined(__AVX512ER__) || \
@@ -44,6 +46,12 @@
 #define INCBIN_ALIGN_SHIFT_4 16
 #define INCBIN_ALIGN_SHIFT_5 32
 #define INCBIN_ALIGN_SHIFT_6 64
+#define INCBIN_ALIGN_SHIFT_7 128
+#define INCBIN_ALIGN_SHIFT_8 256
+#define INCBIN_ALIGN_SHIFT_9 512
+#define INCBIN_ALIGN_SHIFT_10 1024
+#define INCBIN_ALIGN_SHIFT_11 2048
+#define INCBIN_ALIGN_SHIFT_12 4096
 
 /* Actual alignment value */
 #define INCBIN_ALIGNMENT \
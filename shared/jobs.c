@@ -0,0 +1,322 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+//
+//
+//
+
+// Kernels are compiled functions run on the asynchronous workers, cf. async.c,
+// rather than the main thread. They take the form
+//
+//    int kernel (void * const args[], const size_t counts[], int nargs)
+//
+// where each argument is a buffer's elements, and their count, or else a
+// string, and its length, or some other userdata. The integer result is
+// posted back on the main thread, to the kernel's future.
+//
+// Unlike other jobs, kernels belong to no state, so run alongside one
+// another, and any compiles. The future keeps the arguments alive, in its
+// environment, and the state's code, by holding a reference to its module.
+
+#define FUTURE_METATABLE_NAME "solar2c.future"
+
+//
+//
+//
+
+typedef int (*Kernel) (void * const args[], const size_t counts[], int nargs);
+
+typedef struct {
+	Kernel func;
+	int nargs;
+	void ** args;
+	size_t * counts;
+} KernelCall;
+
+typedef struct {
+	AsyncJob * job; // until delivered
+	Module * module; // likewise
+	int result;
+	bool done;
+} Future;
+
+//
+//
+//
+
+static int RunKernel (AsyncJob * job)
+{
+	KernelCall * call = job->ud;
+
+	return call->func(call->args, call->counts, call->nargs);
+}
+
+//
+//
+//
+
+static void Settle (Future * future)
+{
+	future->job = NULL;
+
+	ReleaseModule(future->module);
+
+	future->module = NULL;
+}
+
+//
+//
+//
+
+static void Deliver (lua_State * L, AsyncJob * job)
+{
+	lua_getref(L, job->state_ref); // ..., future
+
+	Future * future = lua_touserdata(L, -1);
+
+	future->result = job->result;
+	future->done = true;
+
+	Settle(future);
+
+	lua_pop(L, 1); // ...
+	lua_unref(L, job->state_ref);
+
+	FreeJob(job);
+}
+
+//
+//
+//
+
+static Future * CheckFuture (lua_State * L)
+{
+	return luaL_checkudata(L, 1, FUTURE_METATABLE_NAME);
+}
+
+//
+//
+//
+
+static int IsDone (lua_State * L)
+{
+	lua_pushboolean(L, CheckFuture(L)->done); // future, done
+
+	return 1;
+}
+
+//
+//
+//
+
+static int Result (lua_State * L)
+{
+	Future * future = CheckFuture(L);
+
+	if (future->done) lua_pushinteger(L, future->result); // future, result
+	else lua_pushnil(L); // future, nil
+
+	return 1;
+}
+
+//
+//
+//
+
+static int Wait (lua_State * L)
+{
+	Future * future = CheckFuture(L);
+
+	if (!future->done)
+	{
+		AsyncJob * job = future->job;
+
+		AwaitJob(job, false);
+		Deliver(L, job);
+	}
+
+	lua_pushinteger(L, future->result); // future, result
+
+	return 1;
+}
+
+//
+//
+//
+
+static int GC (lua_State * L)
+{
+	Future * future = CheckFuture(L);
+
+	// Only possible on close or relaunch, since pending jobs keep their future
+	// alive, so drop the kernel if it hasn't started, else let it finish, before
+	// its code goes away.
+	if (future->job)
+	{
+		AwaitJob(future->job, true);
+		FreeJob(future->job);
+		Settle(future);
+	}
+
+	return 0;
+}
+
+//
+//
+//
+
+static const struct luaL_reg future_methods[] = {
+	{"is_done", IsDone},
+	{"result", Result},
+	{"wait", Wait},
+	{NULL, NULL}
+};
+
+//
+//
+//
+
+static void CheckArgument (lua_State * L, int arg)
+{
+	int type = lua_type(L, arg);
+
+	if (type != LUA_TSTRING && type != LUA_TUSERDATA && type != LUA_TLIGHTUSERDATA && type != LUA_TNIL) luaL_typerror(L, arg, "buffer, string, userdata, or nil");
+}
+
+//
+//
+//
+
+static void GetArgument (lua_State * L, int arg, void ** ptr, size_t * count)
+{
+	Buffer * buffer = ToBuffer(L, arg);
+
+	if (buffer)
+	{
+		*ptr = buffer->data;
+		*count = buffer->count;
+	}
+
+	else if (lua_isstring(L, arg)) *ptr = (void *)lua_tolstring(L, arg, count);
+
+	else
+	{
+		*ptr = lua_touserdata(L, arg);
+		*count = LUA_TUSERDATA == lua_type(L, arg) ? lua_objlen(L, arg) : 0;
+	}
+}
+
+//
+//
+//
+
+static int Submit (lua_State * L)
+{
+	const char * name = luaL_checkstring(L, 2);
+	int nargs = lua_gettop(L) - 2;
+
+	for (int i = 1; i <= nargs; ++i) CheckArgument(L, 2 + i);
+
+	EnsureDrainListener(L); // n.b. calls into Lua, so done before anything is retained
+
+	Future * future = lua_newuserdata(L, sizeof(Future)); // state, name, ..., future
+
+	memset(future, 0, sizeof(Future));
+
+	if (luaL_newmetatable(L, FUTURE_METATABLE_NAME)) // state, name, ..., future, mt
+	{
+		lua_pushvalue(L, -1); // state, name, ..., future, mt, mt
+		lua_setfield(L, -2, "__index"); // state, name, ..., future, mt = { __index = mt }
+		luaL_register(L, NULL, future_methods);
+		lua_pushcfunction(L, GC); // state, name, ..., future, mt, GC
+		lua_setfield(L, -2, "__gc"); // state, name, ..., future, mt = { __index, is_done, result, wait, __gc = GC }
+	}
+
+	lua_setmetatable(L, -2); // state, name, ..., future; future.metatable = mt
+	lua_createtable(L, nargs, 0); // state, name, ..., future, args
+
+	for (int i = 1; i <= nargs; ++i)
+	{
+		lua_pushvalue(L, 2 + i); // state, name, ..., future, args, arg
+		lua_rawseti(L, -2, i); // state, name, ..., future, args = { ..., arg }
+	}
+
+	lua_setfenv(L, -2); // state, name, ..., future; future.environment = args
+
+	Kernel func = (Kernel)GetRetainedSymbol(L, 1, name, &future->module);
+
+	lua_pushvalue(L, -1); // state, name, ..., future, future
+
+	int ref = lua_ref(L, 1); // state, name, ..., future; ref = future (kept alive while the job is in flight)
+
+	/* ----- */
+
+	// Gather everything into one block, so the job frees it in one go.
+	KernelCall * call = malloc(sizeof(KernelCall) + nargs * (sizeof(void *) + sizeof(size_t)));
+	AsyncJob * job = call ? calloc(1, sizeof(AsyncJob)) : NULL;
+
+	if (!job)
+	{
+		free(call);
+		lua_unref(L, ref);
+		ReleaseModule(future->module);
+
+		future->module = NULL;
+
+		return luaL_error(L, "Unable to submit kernel: out of memory");
+	}
+
+	call->func = func;
+	call->nargs = nargs;
+	call->args = (void **)(call + 1);
+	call->counts = (size_t *)(call->args + nargs);
+
+	for (int i = 0; i < nargs; ++i) GetArgument(L, 3 + i, &call->args[i], &call->counts[i]);
+
+	job->run = RunKernel;
+	job->deliver = Deliver;
+	job->ud = call;
+	job->state_ref = ref;
+	future->job = job;
+
+	SubmitJob(job);
+
+	return 1;
+}
+
+//
+//
+//
+
+void PushJobsTable (lua_State * L)
+{
+	lua_createtable(L, 0, 1); // ..., anchor, jobs
+	lua_insert(L, -2); // ..., jobs, anchor
+	lua_pushcclosure(L, Submit, 1); // ..., jobs, Submit
+	lua_setfield(L, -2, "submit"); // ..., jobs = { submit = Submit }
+}
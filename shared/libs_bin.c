@@ -23,4 +23,4 @@
 
 #include "common.h"
 
-INCBIN(libs, "libs.zip");
+INCBIN(libs, "libs.pack");
@@ -0,0 +1,293 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+// Build tool, in the spirit of incbin.c: converts a zip into a pack (see pack.h)
+// suitable for embedding, e.g.
+//
+//    pack -o tcc.pack tcc.zip
+//    pack -z .dll -o libs.pack libs.zip
+//
+// This is not part of the plugin itself; build it alongside miniz.c.
+
+#ifdef _MSC_VER
+#  define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "miniz.h"
+#include "pack.h"
+
+#define SUFFIXES_MAX 16
+
+//
+//
+//
+
+typedef struct {
+	char * name;
+	void * data;
+	size_t size;
+	size_t stored_size;
+} Item;
+
+//
+//
+//
+
+static const char * sCompressSuffixes[SUFFIXES_MAX];
+
+static int sSuffixCount;
+
+//
+//
+//
+
+static int IsJunk (const char * name)
+{
+	// Material introduced by the compressor on Mac.
+	const char * base = strrchr(name, '/');
+
+	base = base ? base + 1 : name;
+
+	return strncmp(name, "__MACOSX/", 9) == 0 || strcmp(base, ".DS_Store") == 0;
+}
+
+//
+//
+//
+
+static int WantsCompression (const char * name)
+{
+	size_t len = strlen(name);
+
+	for (int i = 0; i < sSuffixCount; ++i)
+	{
+		size_t slen = strlen(sCompressSuffixes[i]);
+
+		if (len >= slen && strcmp(name + len - slen, sCompressSuffixes[i]) == 0) return 1;
+	}
+
+	return 0;
+}
+
+//
+//
+//
+
+static int CompareItems (const void * a, const void * b)
+{
+	return strcmp(((const Item *)a)->name, ((const Item *)b)->name);
+}
+
+//
+//
+//
+
+static size_t Align (size_t offset, size_t size)
+{
+	size_t alignment = size >= PACK_PAGE_SIZE ? PACK_PAGE_SIZE : PACK_BLOB_ALIGNMENT;
+
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+//
+//
+//
+
+static void Pad (FILE * out, size_t * pos, size_t to)
+{
+	for (; *pos < to; ++*pos) fputc(0, out);
+}
+
+//
+//
+//
+
+int main (int argc, char ** argv)
+{
+	const char * outfile = "out.pack", * infile = NULL;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) outfile = argv[++i];
+		else if (!strcmp(argv[i], "-z") && i + 1 < argc && sSuffixCount < SUFFIXES_MAX) sCompressSuffixes[sSuffixCount++] = argv[++i];
+		else if (argv[i][0] != '-' && !infile) infile = argv[i];
+		else
+		{
+			fprintf(stderr, "%s [-z suffix...] [-o output] <input.zip>\n", argv[0]);
+			fprintf(stderr, "   -o         - output file [default is \"out.pack\"]\n");
+			fprintf(stderr, "   -z         - compress entries with this suffix (default is to store everything)\n");
+
+			return 1;
+		}
+	}
+
+	if (!infile)
+	{
+		fprintf(stderr, "no input given\n");
+
+		return 1;
+	}
+
+	/* ----- */
+
+	mz_zip_archive zip;
+
+	memset(&zip, 0, sizeof(zip));
+
+	if (!mz_zip_reader_init_file(&zip, infile, 0))
+	{
+		fprintf(stderr, "failed to open `%s'\n", infile);
+
+		return 1;
+	}
+
+	mz_uint n = mz_zip_reader_get_num_files(&zip);
+	Item * items = calloc(n ? n : 1, sizeof(Item));
+	uint32_t count = 0;
+	size_t names_size = 0;
+
+	for (mz_uint i = 0; i < n; ++i)
+	{
+		mz_zip_archive_file_stat stat;
+
+		if (!mz_zip_reader_file_stat(&zip, i, &stat)) continue;
+		if (stat.m_is_directory || IsJunk(stat.m_filename)) continue;
+
+		Item * item = &items[count];
+
+		item->data = mz_zip_reader_extract_to_heap(&zip, i, &item->size, 0);
+
+		if (!item->data)
+		{
+			fprintf(stderr, "failed to extract `%s'\n", stat.m_filename);
+
+			return 1;
+		}
+
+		item->name = strdup(stat.m_filename);
+		item->stored_size = item->size;
+		names_size += strlen(item->name) + 1;
+
+		/* ----- */
+
+		if (WantsCompression(item->name))
+		{
+			size_t out_len;
+			void * compressed = tdefl_compress_mem_to_heap(item->data, item->size, &out_len, TDEFL_DEFAULT_MAX_PROBES);
+
+			if (compressed && out_len < item->size)
+			{
+				mz_free(item->data);
+
+				item->data = compressed;
+				item->stored_size = out_len;
+			}
+
+			else mz_free(compressed);
+		}
+
+		++count;
+	}
+
+	mz_zip_reader_end(&zip);
+
+	qsort(items, count, sizeof(Item), CompareItems);
+
+	/* ----- */
+
+	FILE * out = fopen(outfile, "wb");
+
+	if (!out)
+	{
+		fprintf(stderr, "failed to open `%s' for output\n", outfile);
+
+		return 1;
+	}
+
+	PackHeader header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+
+	header.version = PACK_VERSION;
+	header.count = count;
+
+	fwrite(&header, sizeof(header), 1, out);
+
+	/* ----- */
+
+	size_t names_offset = sizeof(PackHeader) + count * sizeof(PackEntry);
+	size_t name_pos = names_offset, blob_pos = names_offset + names_size;
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		PackEntry entry;
+
+		blob_pos = Align(blob_pos, items[i].stored_size);
+
+		entry.name_offset = (uint32_t)name_pos;
+		entry.offset = (uint32_t)blob_pos;
+		entry.size = (uint32_t)items[i].size;
+		entry.stored_size = (uint32_t)items[i].stored_size;
+
+		fwrite(&entry, sizeof(entry), 1, out);
+
+		name_pos += strlen(items[i].name) + 1;
+		blob_pos += items[i].stored_size;
+	}
+
+	for (uint32_t i = 0; i < count; ++i) fwrite(items[i].name, strlen(items[i].name) + 1, 1, out);
+
+	/* ----- */
+
+	size_t pos = names_offset + names_size;
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		Pad(out, &pos, Align(pos, items[i].stored_size));
+
+		fwrite(items[i].data, 1, items[i].stored_size, out);
+
+		pos += items[i].stored_size;
+
+		mz_free(items[i].data);
+		free(items[i].name);
+	}
+
+	free(items);
+
+	if (fclose(out) != 0)
+	{
+		fprintf(stderr, "failed writing `%s'\n", outfile);
+		remove(outfile);
+
+		return 1;
+	}
+
+	printf("packed %u entries from `%s' into `%s'\n", count, infile, outfile);
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+#ifndef pack_h
+#define pack_h
+
+#include <stdint.h>
+
+// Layout of the asset packs produced by pack.c and embedded via INCBIN:
+//
+// PackHeader, then `count` PackEntry records sorted by name, then the
+// names (NUL-terminated), then the blobs. Blobs of at least a page are
+// page-aligned, smaller ones only to PACK_BLOB_ALIGNMENT, relative to
+// the start of the pack; if the pack itself is page-aligned, as the
+// INCBIN alignment arranges, so are the blobs in memory.
+//
+// A blob whose stored size differs from its size is raw deflate data.
+
+#define PACK_MAGIC "S2CPACK"
+#define PACK_VERSION 1
+#define PACK_PAGE_SIZE 4096
+#define PACK_BLOB_ALIGNMENT 16
+
+//
+//
+//
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+} PackHeader;
+
+typedef struct {
+	uint32_t name_offset; // n.b. all offsets are from the start of the pack
+	uint32_t offset;
+	uint32_t size;
+	uint32_t stored_size;
+} PackEntry;
+
+//
+//
+//
+
+#endif
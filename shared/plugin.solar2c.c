@@ -25,6 +25,7 @@ THE SOFTWARE.
 // Modifications also under the same license
 
 #include <CoronaLua.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
@@ -35,176 +36,1240 @@ THE SOFTWARE.
 //
 
 #define TCC_METATABLE_NAME "solar2c.box"
+#define MAX_MAP_BUFFERS 17 // output, plus one input per argument
 
 //
 //
 //
 
-static TCCState ** GetBox (lua_State * L)
+static Box * GetAnyBoxAt (lua_State * L, int arg)
 {
-	return luaL_checkudata(L, 1, TCC_METATABLE_NAME);
+	Box * box = luaL_checkudata(L, arg, TCC_METATABLE_NAME);
+	
+	// Workers might be using the state, so leave it alone until all of its
+	// asynchronous jobs are delivered.
+	if (box->pending) luaL_error(L, "State still has asynchronous work pending");
+	
+	return box;
+}
+
+//
+//
+//
+
+static Box * GetAnyBox (lua_State * L)
+{
+	return GetAnyBoxAt(L, 1);
+}
+
+//
+//
+//
+
+static Box * GetBox (lua_State * L)
+{
+	Box * box = GetAnyBox(L);
+	
+	if (!box->tcc) luaL_error(L, "State has been finalized");
+	
+	return box;
+}
+
+//
+//
+//
+
+static TCCState * GetState (lua_State * L)
+{
+	return GetBox(L)->tcc;
+}
+
+//
+//
+//
+
+static int Report (lua_State * L, Box * box, int result, const char * fallback)
+{
+	// Diagnostics are only collected while TinyCC runs, letting it clean up
+	// after any failure, so only now is it safe to throw.
+	LogWarnings(&box->diagnostics);
+	
+	if (result)
+	{
+		PushErrorText(L, &box->diagnostics, fallback); // ..., errors
+		
+		return lua_error(L);
+	}
+	
+	return 0;
+}
+
+//
+//
+//
+
+static bool IsCSource (const char * filename)
+{
+	const char * ext = strrchr(filename, '.');
+	
+	return ext && (strcmp(ext, ".c") == 0 || strcmp(ext, ".C") == 0);
+}
+
+//
+//
+//
+
+static int AddFileWith (Box * box, const char * filename, Diagnostics * diags)
+{
+	// Only C sources go through the object cache; objects, libraries, etc.
+	// are loaded as is.
+	Arena * previous = UseArena(box->arena);
+	int result;
+	
+	if (IsCSource(filename) && box->use_cache) result = CompileCached(box, NULL, filename, diags, CollectDiagnostic);
+	
+	else
+	{
+		BudgetArena(box->arena, box->memory_budget); // n.b. checked once the step is done, cf. EndArenaBudget()
+		
+		result = EndArenaBudget(box->arena, tcc_add_file(box->tcc, filename), diags, CollectDiagnostic);
+	}
+	
+	UseArena(previous);
+	
+	return result;
+}
+
+//
+//
+//
+
+static int AddFile (Box * box, const char * filename)
+{
+	return AddFileWith(box, filename, &box->diagnostics);
+}
+
+//
+//
+//
+
+static int CompileWith (Box * box, const char * source, Diagnostics * diags)
+{
+	Arena * previous = UseArena(box->arena);
+	int result;
+	
+	if (box->use_cache) result = CompileCached(box, source, NULL, diags, CollectDiagnostic);
+	
+	else
+	{
+		BudgetArena(box->arena, box->memory_budget);
+		
+		result = EndArenaBudget(box->arena, tcc_compile_string(box->tcc, source), diags, CollectDiagnostic);
+	}
+	
+	UseArena(previous);
+	
+	return result;
+}
+
+//
+//
+//
+
+static int AddIncludePath (Box * box, const char * path)
+{
+	RecordConfig(box, CONFIG_INCLUDE, path);
+	
+	Arena * previous = UseArena(box->arena);
+	int result = tcc_add_include_path(box->tcc, path);
+	
+	UseArena(previous);
+	
+	return result;
+}
+
+//
+//
+//
+
+static int AddSysincludePath (Box * box, const char * path)
+{
+	RecordConfig(box, CONFIG_SYSINCLUDE, path);
+	
+	Arena * previous = UseArena(box->arena);
+	int result = tcc_add_sysinclude_path(box->tcc, path);
+	
+	UseArena(previous);
+	
+	return result;
+}
+
+//
+//
+//
+
+static int AddLibraryPath (Box * box, const char * path)
+{
+	Arena * previous = UseArena(box->arena);
+	int result = tcc_add_library_path(box->tcc, path);
+	
+	UseArena(previous);
+	
+	return result;
+}
+
+//
+//
+//
+
+static int AddSymbol (lua_State * L)
+{
+	Box * box = GetBox(L);
+	
+	const char * name = luaL_checkstring(L, 2);
+	
+	ClearDiagnostics(&box->diagnostics);
+	
+	Arena * previous = UseArena(box->arena);
+	int result = tcc_add_symbol(box->tcc, name, lua_touserdata(L, 3));
+	
+	UseArena(previous);
+	
+	return Report(L, box, result, "error adding symbol");
+}
+
+static int DefineSymbol (lua_State * L)
+{
+	Box * box = GetBox(L);
+	const char * name = luaL_checkstring(L, 2), * value = luaL_optstring(L, 3, "");
+	
+	Arena * previous = UseArena(box->arena);
+	
+	tcc_define_symbol(box->tcc, name, value);
+	UseArena(previous);
+	
+	lua_pushfstring(L, "%s=%s", name, value); // state, name[, value], def
+	RecordConfig(box, CONFIG_DEFINE, lua_tostring(L, -1));
+
+	return 0;
+}
+
+/* function context:compile(source [, chunkname]) end */
+static int lua__tcc__compile(lua_State* L)
+{
+	Box* box = GetBox(L);
+	const char* source = luaL_checkstring(L, 2);
+	
+	ClearDiagnostics(&box->diagnostics);
+	
+	/* compile */
+	return Report(L, box, CompileWith(box, source, &box->diagnostics), "unknown compilation error");
+}
+
+/* function context:add_file(filename) end */
+static int lua__tcc__add_file(lua_State* L)
+{
+	Box* box = GetBox(L);
+	const char* filename = GetResolvedFilename(L, 2, 3);
+
+	ClearDiagnostics(&box->diagnostics);
+	
+	/* add file */
+	return Report(L, box, AddFile(box, filename), lua_pushfstring(L, "can't load file %s", filename));
+}
+
+static int AddMultipleFiles(lua_State* L)
+{
+	return ForEachFile(L, GetBox(L), AddFile, "add file");
+}
+
+/* function context:add_library(libraryname) end */
+static int lua__tcc__add_library(lua_State* L)
+{
+	Box* box = GetBox(L);
+	const char* libname = luaL_checkstring(L, 2);
+	
+	ClearDiagnostics(&box->diagnostics);
+	
+	/* add libs */
+	Arena * previous = UseArena(box->arena);
+	int result = tcc_add_library(box->tcc, libname);
+	
+	UseArena(previous);
+	
+	return Report(L, box, result, lua_pushfstring(L, "can't load library %s", libname));
+}
+
+//
+//
+//
+
+static int Relocate (Box * box, Diagnostics * diags)
+{
+	// Code and data go into blocks of their own, out of the shared code pool
+	// or else straight from the system, so that finalize() can hold on to them.
+	Arena * previous = UseArena(NULL);
+	
+	TrackSystemBlocks(&box->run_blocks);
+	BudgetArena(box->arena, box->memory_budget); // n.b. the run memory itself is not charged
+	BeginRunMemory();
+	
+	int result = tcc_relocate(box->tcc);
+	
+	EndRunMemory(box->tcc, 0 == result);
+	TrackSystemBlocks(NULL);
+	UseArena(previous);
+	
+	return EndArenaBudget(box->arena, result, diags, CollectDiagnostic);
+}
+
+/* function context:relocate() end */
+static int lua__tcc__relocate(lua_State* L)
+{
+	Box* box = GetBox(L);
+	
+	ClearDiagnostics(&box->diagnostics);
+	
+	/* link */
+	return Report(L, box, Relocate(box, &box->diagnostics), "unknown relocation (link) error");
+}
+
+//
+//
+//
+
+typedef struct {
+	Symbol * symbols;
+	char * names;
+	int count;
+	size_t names_size;
+} SymbolTable;
+
+//
+//
+//
+
+static void MeasureSymbol (void * ctx, const char * name, const void * value)
+{
+	SymbolTable * table = ctx;
+	
+	(void)value;
+	
+	++table->count;
+	
+	table->names_size += strlen(name) + 1;
+}
+
+//
+//
+//
+
+static void CopySymbol (void * ctx, const char * name, const void * value)
+{
+	SymbolTable * table = ctx;
+	Symbol * symbol = &table->symbols[table->count++];
+	size_t len = strlen(name) + 1;
+	
+	memcpy(table->names, name, len);
+	
+	symbol->name = table->names;
+	symbol->value = (void *)value;
+	
+	table->names += len;
+}
+
+//
+//
+//
+
+static size_t MeasureSymbols (TCCState * tcc, SymbolTable * table)
+{
+	memset(table, 0, sizeof(SymbolTable));
+	
+	tcc_list_symbols(tcc, table, MeasureSymbol);
+	
+	return table->count * sizeof(Symbol) + table->names_size + 1;
+}
+
+//
+//
+//
+
+static void CopySymbols (TCCState * tcc, SymbolTable * table, void * block)
+{
+	// Snapshot the symbols, names and all, in one block, sized as measured.
+	table->symbols = block;
+	table->names = (char *)(table->symbols + table->count);
+	table->count = 0;
+	
+	tcc_list_symbols(tcc, table, CopySymbol);
 }
 
 //
 //
 //
 
-static TCCState * GetState (lua_State * L)
+static int CompareSymbols (const void * a, const void * b)
+{
+	return strcmp(((const Symbol *)a)->name, ((const Symbol *)b)->name);
+}
+
+//
+//
+//
+
+static bool HasSymbolWithin (const SymbolTable * table, const void * ptr, size_t size)
+{
+	const char * lo = ptr, * hi = lo + size;
+	
+	for (int i = 0; i < table->count; ++i)
+	{
+		const char * value = table->symbols[i].value;
+		
+		if (value >= lo && value < hi) return true;
+	}
+	
+	return false;
+}
+
+//
+//
+//
+
+static void * FindSymbol (const Box * box, const char * name)
+{
+	Symbol key = { name, NULL };
+	const Symbol * symbol = bsearch(&key, box->symbols, box->nsymbols, sizeof(Symbol), CompareSymbols);
+	
+	return symbol ? symbol->value : NULL;
+}
+
+static bool Finalize (Box * box)
+{
+	if (!CanKeepRunMemory()) return false; // n.b. the state stays usable, cf. lua__tcc___gc()
+	
+	SymbolTable table;
+	
+	CopySymbols(box->tcc, &table, malloc(MeasureSymbols(box->tcc, &table)));
+	
+	/* ----- */
+	
+	// Of the blocks that came from relocation, those still holding code and
+	// data are the ones with symbols inside. TinyCC will make their pages
+	// writable again before freeing them, so note their protections now.
+	BlockList * candidates = &box->run_blocks;
+	int count = 0;
+	
+	for (int i = 0; i < candidates->count; ++i)
+	{
+		if (!HasSymbolWithin(&table, candidates->blocks[i], candidates->sizes[i])) continue;
+		
+		candidates->blocks[count] = candidates->blocks[i];
+		candidates->sizes[count++] = candidates->sizes[i];
+	}
+	
+	candidates->count = count;
+	
+	if (0 == count)
+	{
+		free(table.symbols);
+		
+		return false;
+	}
+	
+	PageProtection ** protections = malloc(count * sizeof(PageProtection *));
+	
+	for (int i = 0; i < count; ++i) protections[i] = SaveProtection(candidates->blocks[i], candidates->sizes[i]);
+	
+	/* ----- */
+	
+	// Delete the compiler, minus the blocks in question, then drop everything
+	// else it allocated, and finally restore the kept pages.
+	BlockList kept = { 0 };
+	
+	Arena * previous = UseArena(box->arena);
+	
+	KeepBlocks(candidates, &kept);
+	tcc_delete(box->tcc);
+	KeepBlocks(NULL, NULL);
+	UseArena(previous);
+	DestroyArena(box->arena);
+	
+	box->tcc = NULL;
+	box->arena = NULL;
+	
+	Module * module = box->module;
+	
+	module->protections = malloc((kept.count ? kept.count : 1) * sizeof(PageProtection *));
+	
+	for (int i = 0; i < count; ++i)
+	{
+		int index = 0;
+		
+		while (index < kept.count && kept.blocks[index] != candidates->blocks[i]) ++index;
+		
+		if (index < kept.count)
+		{
+			ApplyProtection(protections[i]);
+			
+			module->protections[index] = protections[i];
+		}
+		
+		else free(protections[i]); // n.b. not TinyCC's after all, so leave the pages alone
+	}
+	
+	free(protections);
+	FreeBlockList(&box->run_blocks);
+	ClearConfig(box);
+	
+	module->blocks = kept;
+	
+	/* ----- */
+	
+	qsort(table.symbols, table.count, sizeof(Symbol), CompareSymbols);
+	
+	box->symbols = table.symbols;
+	box->nsymbols = table.count;
+	
+	return true;
+}
+
+/* function context:finalize() end */
+static int lua__tcc__finalize(lua_State* L)
+{
+	if (!CanKeepRunMemory()) return luaL_error(L, "Unable to finalize: not supported by this build of TinyCC");
+	if (!Finalize(GetBox(L))) return luaL_error(L, "Unable to finalize: state has not been relocated");
+	
+	return 0;
+}
+
+static size_t SumBlocks (const BlockList * list)
+{
+	size_t sum = 0;
+	
+	for (int i = 0; i < list->count; ++i) sum += list->sizes[i];
+	
+	return sum;
+}
+
+/* function context:memory() return usage end */
+static int lua__tcc__memory(lua_State* L)
+{
+	Box* box = GetAnyBox(L);
+	ArenaStats stats = { 0, 0, 0 };
+	
+	if (box->arena) GetArenaStats(box->arena, &stats); // n.b. none once finalized
+	
+	lua_createtable(L, 0, 5); // state, usage
+	lua_pushnumber(L, (lua_Number)stats.in_use); // state, usage, heap
+	lua_setfield(L, -2, "heap"); // state, usage = { heap = heap }
+	lua_pushnumber(L, (lua_Number)stats.peak); // state, usage, peak
+	lua_setfield(L, -2, "peak"); // state, usage = { heap, peak = peak }
+	lua_pushnumber(L, (lua_Number)stats.reserved); // state, usage, reserved
+	lua_setfield(L, -2, "reserved"); // state, usage = { heap, peak, reserved = reserved }
+	lua_pushnumber(L, (lua_Number)(box->tcc ? SumBlocks(&box->run_blocks) : SumBlocks(&box->module->blocks))); // state, usage, code
+	lua_setfield(L, -2, "code"); // state, usage = { heap, peak, reserved, code = code }
+	
+	if (box->memory_budget)
+	{
+		lua_pushnumber(L, (lua_Number)box->memory_budget); // state, usage, budget
+		lua_setfield(L, -2, "budget"); // state, usage = { heap, peak, reserved, code, budget = budget }
+	}
+	
+	return 1;
+}
+
+/* function context:set_memory_budget([bytes]) end */
+static int lua__tcc__set_memory_budget(lua_State* L)
+{
+	Box* box = GetBox(L);
+	lua_Number budget = luaL_optnumber(L, 2, 0);
+	
+	luaL_argcheck(L, budget >= 0, 2, "Budget must be non-negative");
+	
+	box->memory_budget = (size_t)budget;
+	
+	return 0;
+}
+
+/* function context:diagnostics() return list end */
+static int lua__tcc__diagnostics(lua_State* L)
+{
+	PushDiagnostics(L, &GetAnyBox(L)->diagnostics); // state, list
+	
+	return 1;
+}
+
+void ReleaseModule (Module * module)
+{
+	if (--module->refs > 0) return;
+	
+	for (int i = 0; i < module->blocks.count; ++i)
+	{
+		ResetProtection(module->protections[i]);
+		ReleaseBlock(module->blocks.blocks[i]);
+	}
+	
+	if (module->tcc)
+	{
+		Arena * previous = UseArena(module->arena);
+		
+		tcc_delete(module->tcc);
+		UseArena(previous);
+		DestroyArena(module->arena);
+	}
+	
+	FreeCallbacks(module->callbacks);
+	free(module->protections);
+	FreeBlockList(&module->blocks);
+	free(module);
+}
+
+//
+//
+//
+
+#define PIN_METATABLE_NAME "solar2c.pin"
+
+//
+//
+//
+
+static int ReleasePin (lua_State * L)
+{
+	Module ** pin = luaL_checkudata(L, 1, PIN_METATABLE_NAME);
+	
+	if (*pin) ReleaseModule(*pin);
+	
+	*pin = NULL;
+	
+	return 0;
+}
+
+//
+//
+//
+
+static void PushPin (lua_State * L, Box * box)
+{
+	Module ** pin = lua_newuserdata(L, sizeof(Module *)); // ..., pin
+	
+	*pin = box->module;
+	
+	++box->module->refs;
+	
+	if (luaL_newmetatable(L, PIN_METATABLE_NAME)) // ..., pin, mt
+	{
+		lua_pushcfunction(L, ReleasePin); // ..., pin, mt, ReleasePin
+		lua_setfield(L, -2, "__gc"); // ..., pin, mt = { __gc = ReleasePin }
+	}
+	
+	lua_setmetatable(L, -2); // ..., pin; pin.metatable = mt
+}
+
+static void * LookUpSymbol (lua_State * L, Box * box, const char * funcname)
+{
+	void* sym = box->tcc ? tcc_get_symbol(box->tcc, funcname) : FindSymbol(box, funcname);
+	if (!sym)
+		luaL_error(L, "can't get symbol %s", funcname);
+	
+	return sym;
+}
+
+static void * GetSymbol (lua_State * L, Box * box)
+{
+	return LookUpSymbol(L, box, luaL_checkstring(L, 2));
+}
+
+//
+//
+//
+
+void * GetPinnedSymbol (lua_State * L, int arg, const char * name)
+{
+	Box * box = GetAnyBoxAt(L, arg);
+	void * sym = LookUpSymbol(L, box, name);
+	
+	PushPin(L, box); // ..., pin
+	
+	return sym;
+}
+
+//
+//
+//
+
+void * GetRetainedSymbol (lua_State * L, int arg, const char * name, Module ** module)
+{
+	Box * box = GetAnyBoxAt(L, arg);
+	void * sym = LookUpSymbol(L, box, name);
+	
+	++box->module->refs; // n.b. released with ReleaseModule()
+	
+	*module = box->module;
+	
+	return sym;
+}
+
+static bool PushCachedFunction (lua_State * L, const char * name)
+{
+	lua_getfenv(L, 1); // ..., cache
+	lua_pushstring(L, name); // ..., cache, name
+	lua_rawget(L, -2); // ..., cache, symbol?
+	lua_remove(L, -2); // ..., symbol?
+	
+	if (!lua_isnil(L, -1)) return true;
+	
+	lua_pop(L, 1); // ...
+	
+	return false;
+}
+
+//
+//
+//
+
+static void PushFunction (lua_State * L, Box * box, const char * name, lua_CFunction f)
+{
+	// The symbol might be coming from a state that is, or will
+	// be, unanchored. Since collecting the state would make the
+	// symbol invalid, the latter pins the state's code. Unlike
+	// the state, a pin doesn't keep the compiler alive too.
+	lua_getfenv(L, 1); // ..., cache
+	lua_pushstring(L, name); // ..., cache, name
+	PushPin(L, box); // ..., cache, name, pin
+	lua_pushcclosure(L, f, 1); // ..., cache, name, symbol
+	lua_pushvalue(L, -1); // ..., cache, name, symbol, symbol
+	lua_insert(L, -4); // ..., symbol, cache, name, symbol
+	lua_rawset(L, -3); // ..., symbol, cache; cache[name] = symbol
+	lua_pop(L, 1); // ..., symbol
+}
+
+/* function context:get_symbol(symbolname) return symbol end */
+static int lua__tcc__get_symbol(lua_State* L)
+{
+	Box* box = GetAnyBox(L);
+	const char* name = luaL_checkstring(L, 2);
+	
+	if (!PushCachedFunction(L, name)) PushFunction(L, box, name, GetSymbol(L, box)); // state, name, symbol
+	
+	return 1;
+}
+
+static int MapBuffers (lua_State * L, Box * box, void * sym, const char * signature)
+{
+	// Buffers are mapped as the raw arrays they hold, so the loop depends on
+	// their element types as well as the signature. The output is required.
+	const char * ctypes[MAX_MAP_BUFFERS];
+	void * data[MAX_MAP_BUFFERS];
+	int top = lua_gettop(L), nbuffers = top - 3;
+	size_t n = 0;
+	
+	luaL_argcheck(L, nbuffers >= 2 && nbuffers <= MAX_MAP_BUFFERS, top, "Expected input buffers and an output buffer");
+	
+	for (int i = 0; i < nbuffers; ++i)
+	{
+		int arg = 0 == i ? top : 3 + i; // n.b. output first
+		Buffer * buffer = ToBuffer(L, arg);
+		
+		luaL_argcheck(L, buffer, arg, "Expected buffer");
+		
+		if (0 == i || buffer->count < n) n = buffer->count;
+		
+		ctypes[i] = GetBufferCType(buffer);
+		data[i] = buffer->data;
+	}
+	
+	BufferMapper mapper = GetBufferMapper(signature, ctypes, nbuffers, &box->diagnostics);
+	
+	if (!mapper) Report(L, box, -1, lua_pushfstring(L, "can't make mapper for %s", signature));
+	
+	mapper(sym, data, n);
+	
+	lua_settop(L, top); // state, name, signature, input1, ..., output
+	
+	return 1;
+}
+
+/* function context:map(symbolname, signature, input1, ..., [output]) return output end */
+static int lua__tcc__map(lua_State* L)
+{
+	Box* box = GetAnyBox(L);
+	void* sym = GetSymbol(L, box);
+	const char* signature = luaL_checkstring(L, 3);
+	int nargs;
+	
+	ClearDiagnostics(&box->diagnostics);
+	
+	if (ToBuffer(L, 4)) return MapBuffers(L, box, sym, signature);
+	
+	// As with thunks, mappers are compiled on first use, cf. GetMapper().
+	Mapper mapper = GetMapper(signature, &nargs, &box->diagnostics);
+	
+	if (!mapper) Report(L, box, -1, lua_pushfstring(L, "can't make mapper for %s", signature));
+	
+	int out = 4 + nargs, n = 0;
+	
+	for (int i = 4; i < out; ++i)
+	{
+		luaL_checktype(L, i, LUA_TTABLE);
+		
+		int len = (int)lua_objlen(L, i);
+		
+		if (4 == i || len < n) n = len; // n.b. stop at the end of the shortest input
+	}
+	
+	lua_settop(L, out); // state, name, signature, input1, ..., output?
+	
+	if (lua_isnil(L, out))
+	{
+		lua_createtable(L, n, 0); // state, name, signature, input1, ..., nil, output
+		lua_replace(L, out); // state, name, signature, input1, ..., output
+	}
+	
+	else luaL_checktype(L, out, LUA_TTABLE);
+	
+	luaL_checkstack(L, nargs + 2, "Not enough room to map");
+	
+	mapper(L, sym, 4, out, n);
+	
+	return 1;
+}
+
+/* function context:export([prefix = "export_" or filter]) return functions end */
+static int lua__tcc__export(lua_State* L)
+{
+	Box* box = GetAnyBox(L);
+	bool has_filter = lua_isfunction(L, 2);
+	const char* prefix = has_filter ? NULL : luaL_optstring(L, 2, "export_");
+	size_t prefix_len = prefix ? strlen(prefix) : 0;
+	
+	if (box->tcc && 0 == box->run_blocks.count) return luaL_error(L, "Unable to export: state has not been relocated");
+	
+	lua_settop(L, 2); // state, prefix / filter
+	
+	// Walk every global once. The snapshot goes into a userdata, since the
+	// filter might throw an error.
+	SymbolTable table = { NULL, NULL, 0, 0 };
+	
+	if (box->tcc) CopySymbols(box->tcc, &table, lua_newuserdata(L, MeasureSymbols(box->tcc, &table))); // state, prefix / filter, snapshot
+	else
+	{
+		table.symbols = box->symbols;
+		table.count = box->nsymbols;
+		
+		lua_pushnil(L); // state, prefix / filter, nil
+	}
+	
+	lua_newtable(L); // state, prefix / filter, snapshot?, functions
+	
+	for (int i = 0; i < table.count; ++i)
+	{
+		const char * name = table.symbols[i].name, * key = name + prefix_len;
+		
+		if (has_filter)
+		{
+			lua_pushvalue(L, 2); // state, filter, snapshot?, functions, filter
+			lua_pushstring(L, name); // state, filter, snapshot?, functions, filter, name
+			lua_call(L, 1, 1); // state, filter, snapshot?, functions, key?
+			
+			if (!lua_toboolean(L, -1))
+			{
+				lua_pop(L, 1); // state, filter, snapshot?, functions
+				
+				continue;
+			}
+			
+			else if (lua_isboolean(L, -1))
+			{
+				lua_pop(L, 1); // state, filter, snapshot?, functions
+				lua_pushstring(L, name); // state, filter, snapshot?, functions, name
+			}
+		}
+		
+		else if (strncmp(name, prefix, prefix_len) != 0 || !*key) continue;
+		else lua_pushstring(L, key); // state, prefix, snapshot?, functions, key
+		
+		if (!PushCachedFunction(L, name)) PushFunction(L, box, name, table.symbols[i].value); // state, prefix / filter, snapshot?, functions, key, func
+		
+		lua_rawset(L, 4); // state, prefix / filter, snapshot?, functions = { ..., [key] = func }
+	}
+	
+	return 1;
+}
+
+/* function context:get_function(symbolname, signature) return function end */
+static int lua__tcc__get_function(lua_State* L)
 {
-	return *GetBox(L);
+	Box* box = GetAnyBox(L);
+	void* sym = GetSymbol(L, box);
+	const char* signature = luaL_checkstring(L, 3);
+	
+	ClearDiagnostics(&box->diagnostics);
+	
+	// Thunks are compiled on first use, cf. GetThunk(), then shared by any
+	// other functions with the same signature.
+	lua_CFunction thunk = GetThunk(signature, &box->diagnostics);
+	
+	if (!thunk) Report(L, box, -1, lua_pushfstring(L, "can't make thunk for %s", signature));
+	
+	lua_pushlightuserdata(L, sym); // state, name, signature, sym
+	PushPin(L, box); // state, name, signature, sym, pin
+	lua_pushcclosure(L, thunk, 2); // state, name, signature, func
+	
+	return 1;
 }
 
-//
-//
-//
-
-static int AddSymbol (lua_State * L)
+/* function context:bind_callback(name, func, signature) end */
+static int lua__tcc__bind_callback(lua_State* L)
 {
-	if (tcc_add_symbol(GetState(L), luaL_checkstring(L, 2), lua_touserdata(L, 3)))
+	Box* box = GetBox(L);
+	const char* name = luaL_checkstring(L, 2);
+	const char* signature = luaL_checkstring(L, 4);
+	
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	
+	// Callbacks hold on to the state they were bound with, so it had better
+	// outlive them.
+	if (!lua_pushthread(L)) luaL_error(L, "Callbacks must be bound on the main thread"); // state, name, func, signature, thread
+	
+	ClearDiagnostics(&box->diagnostics);
+	
+	lua_pushvalue(L, 3); // state, name, func, signature, thread, func
+	
+	int ref = luaL_ref(L, LUA_REGISTRYINDEX); // state, name, func, signature, thread
+	Callback* callback = NewCallback(L, ref, signature, box->module->callbacks, &box->diagnostics);
+	
+	if (!callback)
 	{
-		return luaL_error(L, "error adding symbol");
+		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+		
+		Report(L, box, -1, lua_pushfstring(L, "can't make callback for %s", signature));
 	}
+	
+	box->module->callbacks = callback; // n.b. freed along with the code that calls it
+	
+	Arena * previous = UseArena(box->arena);
+	int result = tcc_add_symbol(box->tcc, name, GetCallbackFunction(callback));
+	
+	UseArena(previous);
+	
+	return Report(L, box, result, "error adding symbol");
+}
 
+/* function context:add_library_path(path) end */
+static int lua__tcc__add_library_path(lua_State *L)
+{
+	AddLibraryPath(GetBox(L), GetResolvedFilename(L, 2, 3));
+	
 	return 0;
 }
 
-static int DefineSymbol (lua_State * L)
+static int AddMultipleLibraryPaths (lua_State * L)
 {
-	tcc_define_symbol(GetState(L), luaL_checkstring(L, 2), luaL_optstring(L, 3, ""));
-
-	return 0;
+	return ForEachFile(L, GetBox(L), AddLibraryPath, "add library path");
 }
 
-/* function context:compile(source [, chunkname]) end */
-static int lua__tcc__compile(lua_State* L)
+/* function context:add_include_path(path) end */
+static int lua__tcc__add_include_path(lua_State *L)
 {
-	/* compile */
-	if (tcc_compile_string(GetState(L), luaL_checkstring(L, 2)))
-	{
-		return luaL_error(L, "unknown compilation error");
-	}
+	AddIncludePath(GetBox(L), GetResolvedFilename(L, 2, 3));
 	
 	return 0;
 }
 
-/* function context:add_file(filename) end */
-static int lua__tcc__add_file(lua_State* L)
+static int AddMultipleIncludePaths (lua_State * L)
 {
-	const char* filename = GetResolvedFilename(L, 2, 3);
+	return ForEachFile(L, GetBox(L), AddIncludePath, "add include path");
+}
 
-	/* add file */
-	if (tcc_add_file(GetState(L), filename))
-		return luaL_error(L, "can't load file %s", filename);
+
+/* function context:add_sysinclude_path(path) end */
+static int lua__tcc__add_sysinclude_path(lua_State *L)
+{
+	AddSysincludePath(GetBox(L), GetResolvedFilename(L, 2, 3));
 	
 	return 0;
 }
 
-static int AddMultipleFiles(lua_State* L)
+static int AddMultipleSysincludePaths (lua_State * L)
 {
-	return ForEachFile(L, GetState(L), tcc_add_file, "add file");
+	return ForEachFile(L, GetBox(L), AddSysincludePath, "add sysinclude path");
 }
 
-/* function context:add_library(libraryname) end */
-static int lua__tcc__add_library(lua_State* L)
+static int lua__tcc__detach(lua_State *L)
 {
-	const char* libname = luaL_checkstring(L, 2);
-	
-	/* add libs */
-	if (tcc_add_library(GetState(L), libname))
-		return luaL_error(L, "can't load library %s", libname);
+	luaL_checkudata(L, 1, TCC_METATABLE_NAME);
+	lua_settop(L, 1); // state
+	lua_pushnil(L); // state, nil
+	lua_rawset(L, lua_upvalueindex(1)); // (empty); anchor[state] = nil
 	
 	return 0;
 }
 
-/* function context:relocate() end */
-static int lua__tcc__relocate(lua_State* L)
+static int lua__tcc___gc(lua_State* L)
 {
-	/* link */
-	if (tcc_relocate(GetState(L)))
-		return luaL_error(L, "unknown relocation (link) error");
+	Box* box = luaL_checkudata(L, 1, TCC_METATABLE_NAME);
+	
+	AbandonJobs(box); // n.b. only possible on close or relaunch, since jobs keep their state alive
+	
+	// Functions from get_symbol() might outlive the state, in which case
+	// hand its code over to them.
+	if (box->tcc && box->module && box->module->refs > 1 && !Finalize(box))
+	{
+		// Failing that, the module takes the whole state.
+		box->module->tcc = box->tcc;
+		box->module->arena = box->arena;
+		
+		box->tcc = NULL;
+		box->arena = NULL;
+	}
+	
+	if (box->tcc)
+	{
+		Arena * previous = UseArena(box->arena);
+		
+		tcc_delete(box->tcc);
+		UseArena(previous);
+		
+		box->tcc = NULL;
+	}
+	
+	DestroyArena(box->arena); // whatever TinyCC left behind goes too
+	
+	box->arena = NULL;
+	
+	if (box->module) ReleaseModule(box->module);
+	
+	box->module = NULL;
+	
+	free(box->symbols);
+	FreeBlockList(&box->run_blocks);
+	
+	ClearConfig(box);
+	FreeDiagnostics(&box->diagnostics);
 	
 	return 0;
 }
 
-/* function context:get_symbol(symbolname) return symbol end */
-static int lua__tcc__get_symbol(lua_State* L)
+//
+//
+//
+
+static int RunCompile (AsyncJob * job)
 {
-	const char* funcname = luaL_checkstring(L, 2);
-	void* sym = tcc_get_symbol(GetState(L), funcname);
-	if (!sym)
-		return luaL_error(L, "can't get symbol %s", funcname);
-	lua_CFunction f = sym;
+	Box * box = job->box;
 	
-	// The symbol might be coming from a state that is, or will
-	// be, unanchored. Since collecting the state would make the
-	// symbol invalid, the latter holds a reference of its own.
-
-	lua_pushvalue(L, 1); // state, name, state
-	lua_pushcclosure(L, f, 1); // state, name, symbol
+	tcc_set_error_func(box->tcc, &job->diagnostics, CollectDiagnostic);
 	
-	return 1;
+	int result = CompileWith(box, job->arg, &job->diagnostics);
+	
+	tcc_set_error_func(box->tcc, &box->diagnostics, CollectDiagnostic);
+	
+	return result;
 }
 
-/* function context:add_library_path(path) end */
-static int lua__tcc__add_library_path(lua_State *L)
+//
+//
+//
+
+static int RunAddFile (AsyncJob * job)
 {
-	tcc_add_library_path(GetState(L), GetResolvedFilename(L, 2, 3));
+	Box * box = job->box;
 	
-	return 0;
+	tcc_set_error_func(box->tcc, &job->diagnostics, CollectDiagnostic);
+	
+	int result = AddFileWith(box, job->arg, &job->diagnostics);
+	
+	tcc_set_error_func(box->tcc, &box->diagnostics, CollectDiagnostic);
+	
+	return result;
 }
 
-static int AddMultipleLibraryPaths (lua_State * L)
+//
+//
+//
+
+static int RunRelocate (AsyncJob * job)
 {
-	return ForEachFile(L, GetState(L), tcc_add_library_path, "add library path");
+	Box * box = job->box;
+	
+	tcc_set_error_func(box->tcc, &job->diagnostics, CollectDiagnostic);
+	
+	int result = Relocate(box, &job->diagnostics);
+	
+	tcc_set_error_func(box->tcc, &box->diagnostics, CollectDiagnostic);
+	
+	return result;
 }
 
-/* function context:add_include_path(path) end */
-static int lua__tcc__add_include_path(lua_State *L)
+//
+//
+//
+
+static int DrainJobs (lua_State * L)
 {
-	tcc_add_include_path(GetState(L), GetResolvedFilename(L, 2, 3));
+	// Only deliver what was finished on entry, so that callbacks which keep
+	// submitting quick jobs cannot hold up the frame.
+	for (int n = CountFinishedJobs(); n > 0; --n)
+	{
+		AsyncJob * job = TakeFinishedJob();
+		
+		if (!job) break; // n.b. some were taken meanwhile, e.g. by future:wait()
+		
+		if (job->deliver)
+		{
+			job->deliver(L, job);
+			
+			continue;
+		}
+		
+		--job->box->pending;
+		
+		LogWarnings(&job->diagnostics);
+		
+		lua_getref(L, job->func_ref); // ..., on_done
+		
+		if (job->cancelled)
+		{
+			lua_pushboolean(L, 0); // ..., on_done, false
+			lua_pushliteral(L, "cancelled"); // ..., on_done, false, "cancelled"
+		}
+		
+		else if (job->result)
+		{
+			lua_pushboolean(L, 0); // ..., on_done, false
+			PushErrorText(L, &job->diagnostics, "unknown error"); // ..., on_done, false, err
+		}
+		
+		else
+		{
+			lua_pushboolean(L, 1); // ..., on_done, true
+			lua_pushnil(L); // ..., on_done, true, nil
+		}
+		
+		lua_getref(L, job->state_ref); // ..., on_done, ok, err?, state
+		PushDiagnostics(L, &job->diagnostics); // ..., on_done, ok, err?, state, diagnostics
+		lua_unref(L, job->func_ref);
+		lua_unref(L, job->state_ref);
+		
+		FreeJob(job);
+		
+		// Deliver the rest even if one callback fails.
+		if (lua_pcall(L, 4, 0, 0) != 0) // ...[, message]
+		{
+			CoronaLog("ERROR: %s", lua_tostring(L, -1));
+			
+			lua_pop(L, 1); // ...
+		}
+	}
 	
 	return 0;
 }
 
-static int AddMultipleIncludePaths (lua_State * L)
+//
+//
+//
+
+void EnsureDrainListener (lua_State * L)
 {
-	return ForEachFile(L, GetState(L), tcc_add_include_path, "add include path");
+	// Results are delivered once per frame, by a listener installed on first use; as with
+	// the system headers, its presence is recorded in the anchor.
+	lua_getfield(L, lua_upvalueindex(1), "_DRAIN"); // ..., drain?
+	
+	if (lua_isnil(L, -1))
+	{
+		lua_pushcfunction(L, DrainJobs); // ..., nil, DrainJobs
+		lua_pushvalue(L, -1); // ..., nil, DrainJobs, DrainJobs
+		lua_setfield(L, lua_upvalueindex(1), "_DRAIN"); // ..., nil, DrainJobs; anchor._DRAIN = DrainJobs
+		lua_getglobal(L, "Runtime"); // ..., nil, DrainJobs, Runtime
+		lua_getfield(L, -1, "addEventListener"); // ..., nil, DrainJobs, Runtime, Runtime.addEventListener
+		lua_insert(L, -2); // ..., nil, DrainJobs, Runtime.addEventListener, Runtime
+		lua_pushliteral(L, "enterFrame"); // ..., nil, DrainJobs, Runtime.addEventListener, Runtime, "enterFrame"
+		lua_pushvalue(L, -4); // ..., nil, DrainJobs, Runtime.addEventListener, Runtime, "enterFrame", DrainJobs
+		lua_call(L, 3, 0); // ..., nil, DrainJobs
+		lua_pop(L, 1); // ..., nil
+	}
+	
+	lua_pop(L, 1); // ...
 }
 
+//
+//
+//
 
-/* function context:add_sysinclude_path(path) end */
-static int lua__tcc__add_sysinclude_path(lua_State *L)
+static int Submit (lua_State * L, int (*run)(AsyncJob * job), const char * arg, int func_index)
 {
-	tcc_add_sysinclude_path(GetState(L), GetResolvedFilename(L, 2, 3));
+	Box * box = luaL_checkudata(L, 1, TCC_METATABLE_NAME);
 	
-	return 0;
+	luaL_argcheck(L, box->tcc, 1, "State has been finalized");
+	luaL_checktype(L, func_index, LUA_TFUNCTION);
+	
+	int priority = luaL_optint(L, func_index + 1, 0);
+	
+	EnsureDrainListener(L);
+	
+	lua_pushvalue(L, func_index); // state, ..., on_done
+	
+	int func_ref = lua_ref(L, 1); // state, ...; ref = on_done
+	
+	lua_pushvalue(L, 1); // state, ..., state
+	
+	int state_ref = lua_ref(L, 1); // state, ...; ref = state (kept alive while the job is in flight)
+	
+	// Everything that might throw is done, so only now allocate the job.
+	AsyncJob * job = calloc(1, sizeof(AsyncJob));
+	
+	job->box = box;
+	job->run = run;
+	job->priority = priority;
+	job->func_ref = func_ref;
+	job->state_ref = state_ref;
+	
+	if (arg)
+	{
+		job->arg = malloc(strlen(arg) + 1); // n.b. the Lua string might be collected meanwhile
+		
+		strcpy(job->arg, arg);
+	}
+	
+	lua_pushinteger(L, SubmitJob(job)); // state, ..., id
+	
+	return 1;
 }
 
-static int AddMultipleSysincludePaths (lua_State * L)
+/* function context:compile_async(source, on_done [, priority]) return id end */
+static int lua__tcc__compile_async(lua_State* L)
 {
-	return ForEachFile(L, GetState(L), tcc_add_sysinclude_path, "add sysinclude path");
+	return Submit(L, RunCompile, luaL_checkstring(L, 2), 3);
 }
 
-static int lua__tcc__detach(lua_State *L)
+/* function context:add_file_async(filename [, baseDir], on_done [, priority]) return id end */
+static int lua__tcc__add_file_async(lua_State* L)
 {
-	luaL_checkudata(L, 1, TCC_METATABLE_NAME);
-	lua_settop(L, 1); // state
-	lua_pushnil(L); // state, nil
-	lua_rawset(L, lua_upvalueindex(1)); // (empty); anchor[state] = nil
+	if (lua_isfunction(L, 3))
+	{
+		lua_pushnil(L); // state, filename, on_done[, priority], nil
+		lua_insert(L, 3); // state, filename, nil, on_done[, priority]
+	}
 	
-	return 0;
+	return Submit(L, RunAddFile, GetResolvedFilename(L, 2, 3), 4);
 }
 
-static int lua__tcc___gc(lua_State* L)
+/* function context:relocate_async(on_done [, priority]) return id end */
+static int lua__tcc__relocate_async(lua_State* L)
+{
+	return Submit(L, RunRelocate, NULL, 2);
+}
+
+/* function context:cancel_async([id]) return count end */
+static int lua__tcc__cancel_async(lua_State* L)
 {
-	TCCState** ptcc = GetBox(L);
+	Box* box = luaL_checkudata(L, 1, TCC_METATABLE_NAME);
 	
-	if (ptcc && *ptcc)
-	{
-		tcc_delete(*ptcc);
-	}
+	lua_pushinteger(L, CancelJobs(box, luaL_optint(L, 2, 0))); // state[, id], count
 	
-	return 0;
+	return 1;
 }
 
 static const struct luaL_reg tcc_methods[] = {
@@ -216,26 +1281,60 @@ static const struct luaL_reg tcc_methods[] = {
 	{"add_library", lua__tcc__add_library},
 	{"relocate", lua__tcc__relocate},
 	{"get_symbol", lua__tcc__get_symbol},
+	{"get_function", lua__tcc__get_function},
+	{"bind_callback", lua__tcc__bind_callback},
+	{"export", lua__tcc__export},
+	{"map", lua__tcc__map},
 	{"add_library_path", lua__tcc__add_library_path},
 	{"add_include_path", lua__tcc__add_include_path},
 	{"add_sysinclude_path", lua__tcc__add_sysinclude_path},
 	{"add_multiple_library_paths", AddMultipleLibraryPaths},
 	{"add_multiple_include_paths", AddMultipleIncludePaths},
 	{"add_multiple_sysinclude_paths", AddMultipleSysincludePaths},
+	{"cancel_async", lua__tcc__cancel_async},
+	{"diagnostics", lua__tcc__diagnostics},
+	{"finalize", lua__tcc__finalize},
+	{"memory", lua__tcc__memory},
+	{"set_memory_budget", lua__tcc__set_memory_budget},
 	{NULL, NULL}
 };
 
-void luatcc__error_func(void* opaque, const char* msg)
+//
+//
+//
+
+static Thread * sExtractionThread;
+
+static bool sToolchainReady;
+
+//
+//
+//
+
+static void ExtractToTempDir (void * ud)
 {
-	if (strstr(msg, "warning: "))
-	{
-		CoronaLog("WARNING: %s", msg);
-	}
+	(void)ud;
 	
-	else
-	{
-		luaL_error((lua_State*)opaque, "%s", msg);
-	}
+	if (IsExtractionCurrent()) return; // tree from an earlier launch still matches?
+	
+	ExtractArchives();
+	FixLib(); // write the architecture-appropriate binary where TinyCC can find it
+	WriteManifest(); // n.b. written last, so an interrupted extraction is redone
+}
+
+//
+//
+//
+
+static void WaitForToolchain (void)
+{
+	if (sToolchainReady) return;
+	
+	if (sExtractionThread) JoinThread(sExtractionThread);
+	else ExtractToTempDir(NULL); // unable to spawn, so do it here
+	
+	sExtractionThread = NULL;
+	sToolchainReady = true;
 }
 
 //
@@ -244,30 +1343,73 @@ void luatcc__error_func(void* opaque, const char* msg)
 
 static int lua__new(lua_State* L)
 {
+	WaitForToolchain();
+	
+	Arena* arena = NewArena(), * previous = UseArena(arena);
+	
 	TCCState* tcc = tcc_new();
 	if (!tcc)
+	{
+		UseArena(previous);
+		DestroyArena(arena);
+		
 		return luaL_error(L, "can't create tcc state");
+	}
 	
 	tcc_set_output_type(tcc, TCC_OUTPUT_MEMORY);
-	tcc_set_error_func(tcc, L, luatcc__error_func);
+	
+	AddSchedulerSymbols(tcc); // n.b. solar2c_parallel_for(), etc.
+	AddCallbackSymbols(tcc); // n.b. solar2c_callback_failed()
+	UseArena(previous);
+	
+	Box* box = lua_newuserdata(L, sizeof(Box)); // state
+	
+	memset(box, 0, sizeof(Box));
+	
+	box->tcc = tcc;
+	box->arena = arena;
+	box->module = calloc(1, sizeof(Module));
+	box->module->refs = 1;
+	
+	tcc_set_error_func(tcc, &box->diagnostics, CollectDiagnostic); // n.b. never throws, cf. Report()
+	
+	lua_getfield(L, lua_upvalueindex(1), "_OBJECT_CACHE"); // state, use_cache?
+	
+	box->use_cache = lua_toboolean(L, -1);
+	
+	lua_pop(L, 1); // state
 	
 	/* ----- */
 
 	Paths * paths = lua_touserdata(L, lua_upvalueindex(2));
 
-	tcc_add_sysinclude_path(tcc, paths->Corona);
-	tcc_add_sysinclude_path(tcc, paths->Lua);
+	AddSysincludePath(box, paths->Corona);
+	AddSysincludePath(box, paths->Lua);
 	
-	lua_getfield(L, lua_upvalueindex(1), "_HEADERS"); // headers?
+	lua_getfield(L, lua_upvalueindex(1), "_HEADERS"); // state, headers?
 	
-	if (!lua_isnil(L, -1)) tcc_add_sysinclude_path(tcc, lua_tostring(L, -1));
+	if (!lua_isnil(L, -1)) AddSysincludePath(box, lua_tostring(L, -1));
 	
+	lua_pop(L, 1); // state
 
-	tcc_add_include_path(tcc, GetFileInTempDir("include"));
+	AddIncludePath(box, GetFileInTempDir("include"));
 
 #ifdef WIN32
-	tcc_add_include_path(tcc, GetFileInTempDir("include/winapi"));
+	AddIncludePath(box, GetFileInTempDir("include/winapi"));
+#endif
+
+	// Put the flattened headers ahead of the originals, cf. PrepareFlatHeaders().
+	lua_getfield(L, lua_upvalueindex(1), "_NO_FLATTENING"); // state, no_flattening?
+	
+	const char * flat_dir = lua_toboolean(L, -1) ? NULL : PrepareFlatHeaders(box);
+	
+	lua_pop(L, 1); // state
+	
+	if (flat_dir) AddIncludePath(box, flat_dir);
 
+	previous = UseArena(arena);
+
+#ifdef WIN32
 	tcc_add_library_path(tcc, GetFileInTempDir(NULL));
 
 	tcc_add_library_path(tcc, GetFileInTempDir("library"));
@@ -278,27 +1420,54 @@ static int lua__new(lua_State* L)
 	tcc_add_library_path(tcc, GetFileInTempDir(NULL));
 #endif
 
+	UseArena(previous);
+
 	/* ----- */
 
-	TCCState** ptcc = lua_newuserdata(L, sizeof(TCCState*)); // headers?, state
-	*ptcc = tcc;
-	
-	if (luaL_newmetatable(L, TCC_METATABLE_NAME)) // headers?, state, mt
+	if (luaL_newmetatable(L, TCC_METATABLE_NAME)) // state, mt
 	{
-		lua_pushvalue(L, -1); // headers?, state, mt, mt
-		lua_setfield(L, -2, "__index"); // headers?, state, mt = { __index = mt }
+		lua_pushvalue(L, -1); // state, mt, mt
+		lua_setfield(L, -2, "__index"); // state, mt = { __index = mt }
 		luaL_register(L, NULL, tcc_methods);
-		lua_pushvalue(L, lua_upvalueindex(1)); // headers?, state, mt, anchor
-		lua_pushcclosure(L, lua__tcc__detach, 1); // headers?, state, mt, Detach
-		lua_setfield(L, -2, "detach"); // headers?, state, mt = { __index, detach = Detach }
-		lua_pushcfunction(L, lua__tcc___gc); // headers?, state, mt, GC
-		lua_setfield(L, -2, "__gc"); // headers?, state, mt = { __index, detach, __gc = GC }
+		lua_pushvalue(L, lua_upvalueindex(1)); // state, mt, anchor
+		lua_pushcclosure(L, lua__tcc__detach, 1); // state, mt, Detach
+		lua_setfield(L, -2, "detach"); // state, mt = { __index, detach = Detach }
+		lua_pushvalue(L, lua_upvalueindex(1)); // state, mt, anchor
+		lua_pushcclosure(L, lua__tcc__compile_async, 1); // state, mt, CompileAsync
+		lua_setfield(L, -2, "compile_async"); // state, mt = { __index, detach, compile_async = CompileAsync }
+		lua_pushvalue(L, lua_upvalueindex(1)); // state, mt, anchor
+		lua_pushcclosure(L, lua__tcc__add_file_async, 1); // state, mt, AddFileAsync
+		lua_setfield(L, -2, "add_file_async"); // state, mt = { __index, detach, compile_async, add_file_async = AddFileAsync }
+		lua_pushvalue(L, lua_upvalueindex(1)); // state, mt, anchor
+		lua_pushcclosure(L, lua__tcc__relocate_async, 1); // state, mt, RelocateAsync
+		lua_setfield(L, -2, "relocate_async"); // state, mt = { __index, detach, compile_async, add_file_async, relocate_async = RelocateAsync }
+		lua_pushcfunction(L, lua__tcc___gc); // state, mt, GC
+		lua_setfield(L, -2, "__gc"); // state, mt = { __index, detach, compile_async, add_file_async, relocate_async, __gc = GC }
+	}
+	
+	lua_setmetatable(L, -2); // state; state.metatable = mt
+	
+	// Functions from get_symbol() are cached, weakly, in the environment.
+	lua_newtable(L); // state, cache
+	
+	if (luaL_newmetatable(L, "solar2c.weak_values")) // state, cache, weak_mt
+	{
+		lua_pushliteral(L, "v"); // state, cache, weak_mt, "v"
+		lua_setfield(L, -2, "__mode"); // state, cache, weak_mt = { __mode = "v" }
+	}
+	
+	lua_setmetatable(L, -2); // state, cache; cache.metatable = weak_mt
+	lua_setfenv(L, -2); // state; state.environment = cache
+	lua_getfield(L, lua_upvalueindex(1), "_NO_ANCHOR"); // state, no_anchor?
+	
+	if (!lua_toboolean(L, -1))
+	{
+		lua_pushvalue(L, -2); // state, no_anchor, state
+		lua_pushboolean(L, 1); // state, no_anchor, state, true
+		lua_rawset(L, lua_upvalueindex(1)); // state, no_anchor; anchor[state] = true
 	}
 	
-	lua_setmetatable(L, -2); // headers?, state; state.metatable = mt
-	lua_pushvalue(L, -1); // headers?, state, state
-	lua_pushboolean(L, 1); // headers?, state, state, true
-	lua_rawset(L, lua_upvalueindex(1)); // headers?, state; anchor[state] = true
+	lua_pop(L, 1); // state
 	
 	return 1;
 }
@@ -320,17 +1489,39 @@ static int lua__set_system_headers (lua_State * L)
 //
 //
 
-static void ExtractToTempDir (lua_State * L)
+static int lua__enable_object_cache (lua_State * L)
 {
-	PrepareToUnzip(L);
-#ifdef WIN32
-	ExtractZip(libsData, libsSize, "\\library");
-	ExtractZip(tccData, tccSize, NULL);
-#elif __APPLE__
-	ExtractZip(tccData, tccSize);
-#endif // WIN32
+	lua_settop(L, 1); // enable
+	lua_pushboolean(L, lua_toboolean(L, 1)); // enable, enable_bool
+	lua_setfield(L, lua_upvalueindex(1), "_OBJECT_CACHE"); // enable; anchor._OBJECT_CACHE = enable_bool
+	
+	return 0;
+}
+
+//
+//
+//
+
+static int lua__enable_header_flattening (lua_State * L)
+{
+	lua_settop(L, 1); // enable
+	lua_pushboolean(L, !lua_toboolean(L, 1)); // enable, disable_bool
+	lua_setfield(L, lua_upvalueindex(1), "_NO_FLATTENING"); // enable; anchor._NO_FLATTENING = disable_bool
+	
+	return 0;
+}
+
+//
+//
+//
 
-	FixLib(); // rename the architecture-appropriate binary so TinyCC can find it
+static int lua__enable_anchoring (lua_State * L)
+{
+	lua_settop(L, 1); // enable
+	lua_pushboolean(L, !lua_toboolean(L, 1)); // enable, disable_bool
+	lua_setfield(L, lua_upvalueindex(1), "_NO_ANCHOR"); // enable; anchor._NO_ANCHOR = disable_bool
+	
+	return 0;
 }
 
 //
@@ -379,8 +1570,19 @@ static void CheckCoronaHeaders (lua_State * L, const Paths * paths)
 
 static void PopulatePaths (lua_State * L)
 {
-
-	ExtractToTempDir(L);
+	// TinyCC only reads files by path, so the toolchain must be materialized on
+	// disk before any compiling. This is done in the background, so that merely
+	// loading the plugin costs the main thread nothing; the first new() call will
+	// wait for it to finish, if necessary.
+	
+	// Until then, the extraction thread has sole use of GetFileInTempDir().
+	if (sExtractionThread) JoinThread(sExtractionThread); // still going from before a relaunch?
+	
+	PrepareToUnzip(L);
+	MountArchives();
+	
+	sExtractionThread = NewThread(ExtractToTempDir, NULL);
+	sToolchainReady = false;
 	
 	/* ----- */
 	
@@ -409,6 +1611,11 @@ CORONA_EXPORT int luaopen_plugin_solar2c (lua_State * L)
 
 	// States are thus anchored by default until Solar closes
 	// or relaunches, and may opt out with detach().
+
+	// Functions from get_symbol() pin their state's code, so
+	// that outlives the state if need be, and is only freed
+	// once nothing can call into it. Apps relying on this can
+	// opt out of anchoring altogether.
 	
 	// The anchor table consists of (state, true) pairs. These
 	// keys are all userdata, so a (string, string) pair can be
@@ -416,13 +1623,33 @@ CORONA_EXPORT int luaopen_plugin_solar2c (lua_State * L)
 	// system headers, if any, are stored.
 	lua_newtable(L); // plugin, anchor
 	
+	InstallArenaAllocator();
 	PopulatePaths(L); // plugin, anchor, paths
+	FindTinyCCVersion(); // n.b. once paths are known
 
 	lua_pushvalue(L, -2); // plugin, anchor, paths, anchor
-	lua_pushcclosure(L, lua__set_system_headers, 1); // plugin, anchor, SetSystemHeaders
-	lua_setfield(L, -3, "set_system_headers"); // plugin = { set_system_headers = SetSystemHeaders }, anchor
+	lua_pushcclosure(L, lua__set_system_headers, 1); // plugin, anchor, paths, SetSystemHeaders
+	lua_setfield(L, -4, "set_system_headers"); // plugin = { set_system_headers = SetSystemHeaders }, anchor, paths
+	lua_pushvalue(L, -2); // plugin, anchor, paths, anchor
+	lua_pushcclosure(L, lua__enable_object_cache, 1); // plugin, anchor, paths, EnableObjectCache
+	lua_setfield(L, -4, "enable_object_cache"); // plugin = { set_system_headers, enable_object_cache = EnableObjectCache }, anchor, paths
+	lua_pushvalue(L, -2); // plugin, anchor, paths, anchor
+	lua_pushcclosure(L, lua__enable_header_flattening, 1); // plugin, anchor, paths, EnableHeaderFlattening
+	lua_setfield(L, -4, "enable_header_flattening"); // plugin = { set_system_headers, enable_object_cache, enable_header_flattening = EnableHeaderFlattening }, anchor, paths
+	lua_pushvalue(L, -2); // plugin, anchor, paths, anchor
+	lua_pushcclosure(L, lua__enable_anchoring, 1); // plugin, anchor, paths, EnableAnchoring
+	lua_setfield(L, -4, "enable_anchoring"); // plugin = { set_system_headers, enable_object_cache, enable_header_flattening, enable_anchoring = EnableAnchoring }, anchor, paths
+	lua_pushvalue(L, -2); // plugin, anchor, paths, anchor
+	
+	PushJobsTable(L); // plugin, anchor, paths, jobs
+	
+	lua_setfield(L, -4, "jobs"); // plugin = { set_system_headers, enable_object_cache, enable_header_flattening, enable_anchoring, jobs = jobs }, anchor, paths
 	lua_pushcclosure(L, lua__new, 2); // plugin, new
-	lua_setfield(L, -2, "new"); // plugin = { set_system_headers, new = new }
+	lua_setfield(L, -2, "new"); // plugin = { set_system_headers, enable_object_cache, enable_header_flattening, enable_anchoring, jobs, new = new }
+	
+	AddBufferFunction(L); // plugin = { set_system_headers, enable_object_cache, enable_header_flattening, enable_anchoring, jobs, new, buffer }
+	AddCommandsFunction(L); // plugin = { set_system_headers, enable_object_cache, enable_header_flattening, enable_anchoring, jobs, new, buffer, commands }
+	AddFrameHookFunction(L); // plugin = { set_system_headers, enable_object_cache, enable_header_flattening, enable_anchoring, jobs, new, buffer, commands, add_frame_hook }
 	
     return 1;
 }
@@ -0,0 +1,400 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+
+#include <stdlib.h>
+#include "common.h"
+
+//
+//
+//
+
+// A small work-stealing scheduler, offered to compiled code as symbols, cf.
+// AddSchedulerSymbols(). It is shared by every state, and lasts as long as
+// the process.
+//
+// It has no threads of its own, but runs on the async workers, cf. async.c,
+// which take tasks whenever no job is waiting; kernels and parallel loops
+// thus share one set of threads, rather than each oversubscribing the cores.
+// Each worker has a deque of its own, pushing and popping at the tail, while
+// idle threads steal from the heads of the others. Deque 0 belongs to the
+// main thread. A thread waiting on some work runs tasks in the meantime, so
+// nested parallel loops and groups never tie up a worker.
+//
+// The deques are locked, rather than lock-free, but only briefly.
+
+#define MAX_SCHEDULER_WORKERS 16 // n.b. any further workers share the main thread's deque
+#define CHUNKS_PER_THREAD 4
+
+//
+//
+//
+
+typedef struct TaskGroup {
+	int pending; // guarded by the scheduler mutex
+} TaskGroup;
+
+typedef struct {
+	void (*task)(void * ctx);
+	void (*range)(void * ctx, long first, long last); // if task is absent
+	void * ctx;
+	long first, last;
+	TaskGroup * group;
+} Task;
+
+typedef struct {
+	Mutex * mutex;
+	Task * tasks; // ring buffer
+	int head, count, capacity;
+} Deque;
+
+//
+//
+//
+
+static struct {
+	Mutex * mutex; // guards the counts below, and any group's
+	Condition * changed; // a task was pushed or finished
+	Deque deques[MAX_SCHEDULER_WORKERS + 1];
+	int ndeques, available;
+} sScheduler;
+
+static THREAD_LOCAL int tDeque; // n.b. 0 outside the pool
+
+//
+//
+//
+
+static void Push (const Task * task)
+{
+	Deque * deque = &sScheduler.deques[tDeque];
+
+	LockMutex(deque->mutex);
+
+	if (deque->count == deque->capacity)
+	{
+		int capacity = deque->capacity ? deque->capacity * 2 : 64;
+		Task * tasks = malloc(capacity * sizeof(Task));
+
+		for (int i = 0; i < deque->count; ++i) tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+
+		free(deque->tasks);
+
+		deque->tasks = tasks;
+		deque->head = 0;
+		deque->capacity = capacity;
+	}
+
+	deque->tasks[(deque->head + deque->count++) % deque->capacity] = *task;
+
+	UnlockMutex(deque->mutex);
+
+	/* ----- */
+
+	LockMutex(sScheduler.mutex);
+
+	++sScheduler.available;
+
+	BroadcastCondition(sScheduler.changed);
+	UnlockMutex(sScheduler.mutex);
+	WakeAsyncWorkers(); // n.b. after the count is up, so no idle worker misses it
+}
+
+//
+//
+//
+
+static bool TakeFrom (Deque * deque, bool steal, Task * task)
+{
+	bool found = false;
+
+	LockMutex(deque->mutex);
+
+	if (deque->count > 0)
+	{
+		int index = steal ? deque->head : (deque->head + deque->count - 1) % deque->capacity;
+
+		*task = deque->tasks[index];
+
+		if (steal) deque->head = (deque->head + 1) % deque->capacity;
+
+		--deque->count;
+
+		found = true;
+	}
+
+	UnlockMutex(deque->mutex);
+
+	return found;
+}
+
+//
+//
+//
+
+static bool Take (Task * task)
+{
+	// Newest first from our own deque, which is likeliest to be in cache, else
+	// the oldest, and thus probably largest, piece of work from another.
+	bool found = TakeFrom(&sScheduler.deques[tDeque], false, task);
+
+	for (int i = 1; i < sScheduler.ndeques && !found; ++i) found = TakeFrom(&sScheduler.deques[(tDeque + i) % sScheduler.ndeques], true, task);
+
+	if (found)
+	{
+		LockMutex(sScheduler.mutex);
+
+		--sScheduler.available;
+
+		UnlockMutex(sScheduler.mutex);
+	}
+
+	return found;
+}
+
+//
+//
+//
+
+static void Run (const Task * task)
+{
+	if (task->task) task->task(task->ctx);
+	else task->range(task->ctx, task->first, task->last);
+
+	LockMutex(sScheduler.mutex);
+
+	if (0 == --task->group->pending) BroadcastCondition(sScheduler.changed);
+
+	UnlockMutex(sScheduler.mutex);
+}
+
+//
+//
+//
+
+void EnterScheduler (int index)
+{
+	tDeque = index < sScheduler.ndeques ? index : 0;
+}
+
+//
+//
+//
+
+bool HasSchedulerTasks (void)
+{
+	if (!sScheduler.mutex) return false;
+
+	LockMutex(sScheduler.mutex);
+
+	bool any = sScheduler.available > 0;
+
+	UnlockMutex(sScheduler.mutex);
+
+	return any;
+}
+
+//
+//
+//
+
+void HelpScheduler (void)
+{
+	// One task at a time, so that a worker goes back to any jobs in between.
+	Task task;
+
+	if (Take(&task)) Run(&task);
+}
+
+//
+//
+//
+
+static bool HasWorkers (void)
+{
+	return sScheduler.ndeques > 1; // n.b. else everything runs on the calling thread
+}
+
+//
+//
+//
+
+static void Wait (TaskGroup * group)
+{
+	for (;;)
+	{
+		LockMutex(sScheduler.mutex);
+
+		while (group->pending > 0 && 0 == sScheduler.available) WaitCondition(sScheduler.changed, sScheduler.mutex);
+
+		bool done = 0 == group->pending;
+
+		UnlockMutex(sScheduler.mutex);
+
+		if (done) return;
+
+		/* ----- */
+
+		Task task;
+
+		if (Take(&task)) Run(&task); // n.b. perhaps not one of ours, but it must be done anyway
+	}
+}
+
+//
+//
+//
+
+static void ParallelFor (long begin, long end, long grain, void (*fn)(void * ctx, long first, long last), void * ctx)
+{
+	if (end <= begin) return;
+	if (grain < 1) grain = 1;
+
+	long n = end - begin, nchunks = (n + grain - 1) / grain;
+
+	if (nchunks < 2 || !HasWorkers())
+	{
+		fn(ctx, begin, end);
+
+		return;
+	}
+
+	/* ----- */
+
+	// Chunks are at least a grain in size, but no more numerous than needed to
+	// balance the load.
+	long most = (long)sScheduler.ndeques * CHUNKS_PER_THREAD;
+
+	if (nchunks > most) nchunks = most;
+
+	long size = n / nchunks, extra = n % nchunks;
+	TaskGroup group = { (int)nchunks - 1 };
+	Task task = { NULL, fn, ctx, 0, 0, &group };
+
+	for (long i = nchunks - 1, last = end; i > 0; --i) // n.b. back to front, so thieves get the far end first
+	{
+		task.last = last;
+		task.first = last - size - (i < extra);
+
+		Push(&task);
+
+		last = task.first;
+	}
+
+	fn(ctx, begin, begin + size + (extra > 0));
+
+	Wait(&group);
+}
+
+//
+//
+//
+
+static TaskGroup * NewTaskGroup (void)
+{
+	return calloc(1, sizeof(TaskGroup));
+}
+
+//
+//
+//
+
+static void RunInTaskGroup (TaskGroup * group, void (*fn)(void * ctx), void * ctx)
+{
+	if (!HasWorkers())
+	{
+		fn(ctx);
+
+		return;
+	}
+
+	Task task = { fn, NULL, ctx, 0, 0, group };
+
+	LockMutex(sScheduler.mutex);
+
+	++group->pending;
+
+	UnlockMutex(sScheduler.mutex);
+
+	Push(&task);
+}
+
+//
+//
+//
+
+static void WaitForTaskGroup (TaskGroup * group)
+{
+	if (sScheduler.mutex) Wait(group);
+}
+
+//
+//
+//
+
+static void FreeTaskGroup (TaskGroup * group)
+{
+	WaitForTaskGroup(group);
+
+	free(group);
+}
+
+//
+//
+//
+
+static int GetThreadCount (void)
+{
+	return sScheduler.ndeques;
+}
+
+//
+//
+//
+
+void AddSchedulerSymbols (TCCState * tcc)
+{
+	// Set up on the main thread, along with the first state, so it is ready
+	// before any worker might look; only then do the workers start, if need be.
+	if (!sScheduler.mutex)
+	{
+		int nworkers = CountAsyncWorkers();
+
+		if (nworkers > MAX_SCHEDULER_WORKERS) nworkers = MAX_SCHEDULER_WORKERS;
+
+		sScheduler.mutex = NewMutex();
+		sScheduler.changed = NewCondition();
+		sScheduler.ndeques = nworkers + 1;
+
+		for (int i = 0; i < sScheduler.ndeques; ++i) sScheduler.deques[i].mutex = NewMutex();
+	}
+
+	StartAsyncWorkers();
+
+	tcc_add_symbol(tcc, "solar2c_parallel_for", ParallelFor);
+	tcc_add_symbol(tcc, "solar2c_task_group_new", NewTaskGroup);
+	tcc_add_symbol(tcc, "solar2c_task_group_run", RunInTaskGroup);
+	tcc_add_symbol(tcc, "solar2c_task_group_wait", WaitForTaskGroup);
+	tcc_add_symbol(tcc, "solar2c_task_group_free", FreeTaskGroup);
+	tcc_add_symbol(tcc, "solar2c_thread_count", GetThreadCount);
+}
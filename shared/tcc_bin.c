@@ -27,4 +27,4 @@
 //
 //
 
-INCBIN(tcc, "tcc.zip");
+INCBIN(tcc, "tcc.pack");
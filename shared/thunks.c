@@ -0,0 +1,1030 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+//
+//
+//
+
+// A thunk calls a C function of a given signature, with arguments read off
+// the Lua stack, and pushes its result. Each one is generated and compiled
+// with TinyCC, the first time its signature is wanted, then shared by every
+// function of that signature: the target is the closure's first upvalue.
+//
+// Mappers are made the same way, but run a whole loop, calling a function
+// of numbers with elements from Lua arrays, or else from buffers; the latter
+// are also specific to the buffers' element types. Invokers call a function
+// with arguments already gathered into slots, ignoring any result.
+//
+// Callbacks go the other way, letting compiled code call a Lua function
+// as though it were an ordinary C one. Each is bound to its own function,
+// so is compiled on its own, rather than shared, and lives as long as the
+// module that calls it.
+//
+// All of these declare what they need of the Lua API themselves, rather than
+// include any headers, and have those functions supplied as symbols, so
+// making one is cheap.
+
+//
+//
+//
+
+typedef enum { KIND_VOID, KIND_NUMBER, KIND_BOOLEAN, KIND_STRING, KIND_POINTER } Kind;
+
+typedef struct {
+	const char * name; // as written in signatures
+	const char * ctype; // as declared in the thunk
+	Kind kind;
+} Type;
+
+//
+//
+//
+
+static const Type sTypes[] = {
+	{ "void", "void", KIND_VOID },
+	{ "bool", "_Bool", KIND_BOOLEAN },
+	{ "_Bool", "_Bool", KIND_BOOLEAN },
+	{ "float", "float", KIND_NUMBER },
+	{ "double", "double", KIND_NUMBER },
+	{ "char", "char", KIND_NUMBER },
+	{ "signed char", "signed char", KIND_NUMBER },
+	{ "unsigned char", "unsigned char", KIND_NUMBER },
+	{ "short", "short", KIND_NUMBER },
+	{ "unsigned short", "unsigned short", KIND_NUMBER },
+	{ "int", "int", KIND_NUMBER },
+	{ "unsigned", "unsigned int", KIND_NUMBER },
+	{ "unsigned int", "unsigned int", KIND_NUMBER },
+	{ "long", "long", KIND_NUMBER },
+	{ "unsigned long", "unsigned long", KIND_NUMBER },
+	{ "long long", "long long", KIND_NUMBER },
+	{ "unsigned long long", "unsigned long long", KIND_NUMBER },
+	{ "int8_t", "signed char", KIND_NUMBER },
+	{ "uint8_t", "unsigned char", KIND_NUMBER },
+	{ "int16_t", "short", KIND_NUMBER },
+	{ "uint16_t", "unsigned short", KIND_NUMBER },
+	{ "int32_t", "int", KIND_NUMBER },
+	{ "uint32_t", "unsigned int", KIND_NUMBER },
+	{ "int64_t", "long long", KIND_NUMBER },
+	{ "uint64_t", "unsigned long long", KIND_NUMBER },
+	{ "size_t", "__SIZE_TYPE__", KIND_NUMBER },
+	{ "ptrdiff_t", "__PTRDIFF_TYPE__", KIND_NUMBER },
+	{ "intptr_t", "__PTRDIFF_TYPE__", KIND_NUMBER },
+	{ "uintptr_t", "__SIZE_TYPE__", KIND_NUMBER },
+	{ "lua_Number", "double", KIND_NUMBER },
+	{ NULL, NULL, KIND_VOID }
+};
+
+static const Type sString = { "const char *", "const char *", KIND_STRING };
+static const Type sPointer = { "void *", "void *", KIND_POINTER };
+
+//
+//
+//
+
+typedef enum { THUNK, MAPPER, BUFFER_MAPPER, INVOKER } ThunkKind;
+
+typedef struct Thunk {
+	struct Thunk * next;
+	char * key; // normalized signature, plus any element types
+	void * func;
+	int nargs;
+	char kinds[MAX_THUNK_ARGS + 1]; // for each argument, 'n' if a number (or boolean), else 'p'
+	ThunkKind kind;
+} Thunk;
+
+//
+//
+//
+
+static Thunk * sThunks; // n.b. kept for the life of the process, since they don't depend on any Lua state
+
+//
+//
+//
+
+static void Normalize (char * out, const char * begin, const char * end)
+{
+	// Collapse any whitespace, and drop it next to punctuation.
+	char * start = out;
+
+	for (const char * p = begin; p < end; ++p)
+	{
+		if (strchr(" \t\r\n", *p))
+		{
+			if (out > start && !strchr("*(,", out[-1])) *out++ = ' ';
+		}
+
+		else
+		{
+			if (out > start && ' ' == out[-1] && strchr("*(),", *p)) --out;
+
+			*out++ = *p;
+		}
+	}
+
+	if (out > start && ' ' == out[-1]) --out;
+
+	*out = '\0';
+}
+
+//
+//
+//
+
+static const Type * FindType (const char * name)
+{
+	size_t len = strlen(name);
+
+	if (len > 0 && '*' == name[len - 1])
+	{
+		if (strcmp(name, "char*") == 0 || strcmp(name, "const char*") == 0) return &sString;
+		else return &sPointer; // n.b. every other pointer is just an address here
+	}
+
+	if (strncmp(name, "const ", 6) == 0) name += 6;
+
+	for (int i = 0; sTypes[i].name; ++i)
+	{
+		if (strcmp(name, sTypes[i].name) == 0) return &sTypes[i];
+	}
+
+	return NULL;
+}
+
+//
+//
+//
+
+static bool Reject (const char * what, const char * name, const char * signature, Diagnostics * diags)
+{
+	char message[256];
+
+	if (name) snprintf(message, sizeof(message), "tcc: error: %s \"%.64s\" in signature \"%.128s\"", what, name, signature);
+	else snprintf(message, sizeof(message), "tcc: error: %s signature \"%.128s\"", what, signature);
+	CollectDiagnostic(diags, message);
+
+	return false;
+}
+
+//
+//
+//
+
+static bool Parse (const char * signature, const Type * types[], int * nargs, Diagnostics * diags)
+{
+	// Expecting "ret(arg,...)", with each type one from sTypes or a pointer.
+	const char * open = strchr(signature, '('), * close = strrchr(signature, ')');
+	char name[128];
+
+	if (!open || !close || close < open || close[1] || open - signature >= (long)sizeof(name)) return Reject("malformed", NULL, signature, diags);
+
+	Normalize(name, signature, open);
+
+	types[0] = FindType(name);
+
+	if (!types[0]) return Reject("unsupported return type", name, signature, diags);
+
+	/* ----- */
+
+	*nargs = 0;
+
+	if (open + 1 == close || strncmp(open + 1, "void)", 5) == 0) return true;
+
+	for (const char * begin = open + 1, * end; begin < close; begin = end + 1)
+	{
+		end = begin + strcspn(begin, ",)");
+
+		if (MAX_THUNK_ARGS == *nargs) return Reject("too many arguments in", NULL, signature, diags);
+		if (end - begin >= (long)sizeof(name)) return Reject("overlong type in", NULL, signature, diags);
+
+		Normalize(name, begin, end);
+
+		const Type * type = FindType(name);
+
+		if (!type || KIND_VOID == type->kind) return Reject("unsupported type", name, signature, diags);
+
+		types[++*nargs] = type;
+	}
+
+	return true;
+}
+
+//
+//
+//
+
+static void Append (char * buf, size_t size, const char * fmt, ...)
+{
+	size_t len = strlen(buf);
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(buf + len, size - len, fmt, args);
+	va_end(args);
+}
+
+//
+//
+//
+
+static const char sPrologue[] =
+	"typedef struct lua_State lua_State;\n"
+	"void * lua_touserdata (lua_State *, int);\n"
+	"int lua_toboolean (lua_State *, int);\n"
+	"int lua_isnumber (lua_State *, int);\n"
+	"double lua_tonumber (lua_State *, int);\n"
+	"double luaL_checknumber (lua_State *, int);\n"
+	"const char * luaL_checklstring (lua_State *, int, __SIZE_TYPE__ *);\n"
+	"void lua_pushnil (lua_State *);\n"
+	"void lua_pushnumber (lua_State *, double);\n"
+	"void lua_pushboolean (lua_State *, int);\n"
+	"void lua_pushstring (lua_State *, const char *);\n"
+	"void lua_pushlightuserdata (lua_State *, void *);\n"
+	"void lua_rawgeti (lua_State *, int, int);\n"
+	"void lua_rawseti (lua_State *, int, int);\n"
+	"void lua_settop (lua_State *, int);\n"
+	"int luaL_error (lua_State *, const char *, ...);\n"
+	"int lua_gettop (lua_State *);\n"
+	"int lua_checkstack (lua_State *, int);\n"
+	"void lua_call (lua_State *, int, int);\n"
+	"void * to_pointer (lua_State *, int);\n";
+
+//
+//
+//
+
+static void DeclareTarget (char * source, size_t size, const Type * types[], int nargs, const char * init)
+{
+	Append(source, size, "\t%s (*f)(", types[0]->ctype);
+
+	for (int i = 1; i <= nargs; ++i) Append(source, size, "%s%s", i > 1 ? ", " : "", types[i]->ctype);
+
+	Append(source, size, "%s) = %s;\n\t", nargs ? "" : "void", init);
+}
+
+//
+//
+//
+
+static void Generate (char * source, size_t size, const Type * types[], int nargs)
+{
+	*source = '\0';
+
+	Append(source, size, "%sint thunk (lua_State * L)\n{\n", sPrologue);
+
+	char init[64];
+
+	snprintf(init, sizeof(init), "lua_touserdata(L, %d)", lua_upvalueindex(1));
+
+	DeclareTarget(source, size, types, nargs, init);
+
+	/* ----- */
+
+	if (types[0]->kind != KIND_VOID) Append(source, size, "%s r = ", types[0]->ctype);
+
+	Append(source, size, "f(");
+
+	for (int i = 1; i <= nargs; ++i)
+	{
+		const char * sep = i > 1 ? ", " : "";
+
+		switch (types[i]->kind)
+		{
+		case KIND_NUMBER:
+			Append(source, size, "%s(%s)luaL_checknumber(L, %d)", sep, types[i]->ctype, i);
+			break;
+		case KIND_BOOLEAN:
+			Append(source, size, "%slua_toboolean(L, %d) != 0", sep, i);
+			break;
+		case KIND_STRING:
+			Append(source, size, "%sluaL_checklstring(L, %d, 0)", sep, i);
+			break;
+		default:
+			Append(source, size, "%sto_pointer(L, %d)", sep, i); // n.b. buffers give their contents
+		}
+	}
+
+	Append(source, size, ");\n\t");
+
+	/* ----- */
+
+	switch (types[0]->kind)
+	{
+	case KIND_VOID:
+		Append(source, size, "return 0;\n}\n");
+		return;
+	case KIND_NUMBER:
+		Append(source, size, "lua_pushnumber(L, (double)r);\n");
+		break;
+	case KIND_BOOLEAN:
+		Append(source, size, "lua_pushboolean(L, r);\n");
+		break;
+	case KIND_STRING:
+		Append(source, size, "lua_pushstring(L, r);\n"); // n.b. NULL gives nil
+		break;
+	default:
+		Append(source, size, "if (r) lua_pushlightuserdata(L, r);\n\telse lua_pushnil(L);\n");
+	}
+
+	Append(source, size, "\treturn 1;\n}\n");
+}
+
+//
+//
+//
+
+static void GenerateMapper (char * source, size_t size, const Type * types[], int nargs)
+{
+	// The inputs are at stack positions in, in + 1, etc. Since only numbers
+	// are involved, each element is read and checked (on the rare 0) without
+	// a full conversion call.
+	*source = '\0';
+
+	Append(source, size, "%svoid map (lua_State * L, void * target, int in, int out, int n)\n{\n", sPrologue);
+
+	DeclareTarget(source, size, types, nargs, "target");
+
+	Append(source, size, "for (int i = 1; i <= n; ++i)\n\t{\n");
+
+	for (int i = 1; i <= nargs; ++i)
+	{
+		Append(source, size,
+			"\t\tlua_rawgeti(L, in + %d, i);\n"
+			"\t\tdouble a%d = lua_tonumber(L, -1);\n"
+			"\t\tif (0 == a%d && !lua_isnumber(L, -1)) luaL_error(L, \"Element %%d of input %d is not a number\", i);\n",
+			i - 1, i, i, i);
+	}
+
+	Append(source, size, "\t\tlua_settop(L, -%d);\n\t\tlua_pushnumber(L, (double)f(", nargs + 1);
+
+	for (int i = 1; i <= nargs; ++i) Append(source, size, "%s(%s)a%d", i > 1 ? ", " : "", types[i]->ctype, i);
+
+	Append(source, size, "));\n\t\tlua_rawseti(L, out, i);\n\t}\n}\n");
+}
+
+//
+//
+//
+
+static void GenerateBufferMapper (char * source, size_t size, const Type * types[], int nargs, const char * const ctypes[])
+{
+	// The output buffer comes first, then the inputs.
+	*source = '\0';
+
+	Append(source, size, "void map (void * target, void * const * data, __SIZE_TYPE__ n)\n{\n");
+
+	DeclareTarget(source, size, types, nargs, "target");
+
+	Append(source, size, "%s * out = data[0];\n", ctypes[0]);
+
+	for (int i = 1; i <= nargs; ++i) Append(source, size, "\tconst %s * in%d = data[%d];\n", ctypes[i], i, i);
+
+	Append(source, size, "\tfor (__SIZE_TYPE__ i = 0; i < n; ++i) out[i] = (%s)f(", ctypes[0]);
+
+	for (int i = 1; i <= nargs; ++i) Append(source, size, "%s(%s)in%d[i]", i > 1 ? ", " : "", types[i]->ctype, i);
+
+	Append(source, size, ");\n}\n");
+}
+
+//
+//
+//
+
+static void GenerateInvoker (char * source, size_t size, const Type * types[], int nargs)
+{
+	*source = '\0';
+
+	Append(source, size, "typedef union { double n; void * p; } Slot;\nvoid invoke (void * target, const Slot * args)\n{\n");
+
+	DeclareTarget(source, size, types, nargs, "target");
+
+	Append(source, size, "f(");
+
+	for (int i = 1; i <= nargs; ++i)
+	{
+		const char * sep = i > 1 ? ", " : "";
+
+		if (KIND_NUMBER == types[i]->kind) Append(source, size, "%s(%s)args[%d].n", sep, types[i]->ctype, i - 1);
+		else if (KIND_BOOLEAN == types[i]->kind) Append(source, size, "%sargs[%d].n != 0", sep, i - 1);
+		else Append(source, size, "%sargs[%d].p", sep, i - 1);
+	}
+
+	Append(source, size, ");\n}\n");
+}
+
+//
+//
+//
+
+static void GenerateCallback (char * source, size_t size, const Type * types[], int nargs)
+{
+	// The context is found through a symbol, cf. Callback, and the function
+	// through a reference made up front, so a call costs only the pushes
+	// and the call itself, besides making sure it is on the binding thread.
+	*source = '\0';
+
+	Append(source, size, "%stypedef struct { lua_State * L; int ref; const void * thread; } Context;\nextern Context context;\n", sPrologue);
+	Append(source, size, "const void * this_thread (void);\nvoid wrong_thread (void);\n");
+	Append(source, size, "%s callback (", types[0]->ctype);
+
+	for (int i = 1; i <= nargs; ++i) Append(source, size, "%s%s a%d", i > 1 ? ", " : "", types[i]->ctype, i);
+
+	Append(source, size, "%s)\n{\n\tif (this_thread() != context.thread)\n\t{\n\t\twrong_thread();\n\n\t\t", nargs ? "" : "void");
+
+	if (types[0]->kind != KIND_VOID) Append(source, size, "return (%s)0;\n\t}\n\n\t", types[0]->ctype);
+	else Append(source, size, "return;\n\t}\n\n\t");
+
+	Append(source, size, "lua_State * L = context.L;\n\tint top = lua_gettop(L);\n\t");
+	Append(source, size, "lua_checkstack(L, %d);\n\tlua_rawgeti(L, %d, context.ref);\n", nargs + 1, LUA_REGISTRYINDEX);
+
+	for (int i = 1; i <= nargs; ++i)
+	{
+		switch (types[i]->kind)
+		{
+		case KIND_NUMBER:
+			Append(source, size, "\tlua_pushnumber(L, (double)a%d);\n", i);
+			break;
+		case KIND_BOOLEAN:
+			Append(source, size, "\tlua_pushboolean(L, a%d);\n", i);
+			break;
+		case KIND_STRING:
+			Append(source, size, "\tlua_pushstring(L, a%d);\n", i); // n.b. NULL gives nil
+			break;
+		default:
+			Append(source, size, "\tif (a%d) lua_pushlightuserdata(L, a%d);\n\telse lua_pushnil(L);\n", i, i);
+		}
+	}
+
+	Append(source, size, "\tlua_call(L, %d, %d);\n\t", nargs, KIND_VOID != types[0]->kind);
+
+	/* ----- */
+
+	switch (types[0]->kind)
+	{
+	case KIND_VOID:
+		Append(source, size, "lua_settop(L, top);\n}\n");
+		return;
+	case KIND_NUMBER:
+		Append(source, size, "%s r = (%s)lua_tonumber(L, -1);\n", types[0]->ctype, types[0]->ctype);
+		break;
+	case KIND_BOOLEAN:
+		Append(source, size, "_Bool r = lua_toboolean(L, -1) != 0;\n");
+		break;
+	default:
+		Append(source, size, "void * r = to_pointer(L, -1);\n"); // n.b. buffers give their contents
+	}
+
+	Append(source, size, "\tlua_settop(L, top);\n\treturn r;\n}\n");
+}
+
+//
+//
+//
+
+static THREAD_LOCAL char tThreadMarker; // n.b. only the address matters, being unique to each thread
+
+//
+//
+//
+
+static const void * GetThreadMarker (void)
+{
+	return &tThreadMarker;
+}
+
+//
+//
+//
+
+static THREAD_LOCAL int tCallbackFailed;
+
+//
+//
+//
+
+static void WrongThread (void)
+{
+	// The Lua state belongs to the thread that bound the callback, and there is
+	// no safe way to raise an error from anywhere else, so the callback returns
+	// a zero result instead, leaving this for the caller to check.
+	tCallbackFailed = 1;
+}
+
+//
+//
+//
+
+static int CallbackFailed (void)
+{
+	int failed = tCallbackFailed;
+
+	tCallbackFailed = 0;
+
+	return failed;
+}
+
+//
+//
+//
+
+void AddCallbackSymbols (TCCState * tcc)
+{
+	tcc_add_symbol(tcc, "solar2c_callback_failed", CallbackFailed);
+}
+
+//
+//
+//
+
+typedef struct {
+	BlockList blocks; // run memory, kept past the compiler
+	PageProtection ** protections; // for each kept block
+	TCCState * tcc; // else the compiler, kept whole, cf. CanKeepRunMemory()...
+	Arena * arena; // ...along with its arena
+} Code;
+
+//
+//
+//
+
+typedef struct {
+	const unsigned char * begin, * end;
+	bool found;
+} Range;
+
+//
+//
+//
+
+static void FindInRange (void * ctx, const char * name, const void * value)
+{
+	Range * range = ctx;
+
+	(void)name;
+
+	if ((const unsigned char *)value >= range->begin && (const unsigned char *)value < range->end) range->found = true;
+}
+
+//
+//
+//
+
+static void KeepCode (TCCState * tcc, BlockList * candidates, Code * code)
+{
+	// As with finalize(), the blocks worth keeping are those with symbols
+	// inside. TinyCC will make their pages writable again before freeing them,
+	// so note their protections first.
+	int count = 0;
+
+	for (int i = 0; i < candidates->count; ++i)
+	{
+		Range range = { candidates->blocks[i], (const unsigned char *)candidates->blocks[i] + candidates->sizes[i], false };
+
+		tcc_list_symbols(tcc, &range, FindInRange);
+
+		if (!range.found) continue;
+
+		candidates->blocks[count] = candidates->blocks[i];
+		candidates->sizes[count++] = candidates->sizes[i];
+	}
+
+	candidates->count = count;
+
+	PageProtection ** protections = malloc((count ? count : 1) * sizeof(PageProtection *));
+
+	for (int i = 0; i < count; ++i) protections[i] = SaveProtection(candidates->blocks[i], candidates->sizes[i]);
+
+	/* ----- */
+
+	KeepBlocks(candidates, &code->blocks);
+	tcc_delete(tcc);
+	KeepBlocks(NULL, NULL);
+
+	code->protections = malloc((code->blocks.count ? code->blocks.count : 1) * sizeof(PageProtection *));
+
+	for (int i = 0; i < count; ++i)
+	{
+		int index = 0;
+
+		while (index < code->blocks.count && code->blocks.blocks[index] != candidates->blocks[i]) ++index;
+
+		if (index < code->blocks.count)
+		{
+			ApplyProtection(protections[i]);
+
+			code->protections[index] = protections[i];
+		}
+
+		else free(protections[i]);
+	}
+
+	free(protections);
+}
+
+//
+//
+//
+
+static void ReleaseCode (Code * code, bool release)
+{
+	for (int i = 0; i < code->blocks.count; ++i)
+	{
+		if (release)
+		{
+			ResetProtection(code->protections[i]);
+			ReleaseBlock(code->blocks.blocks[i]);
+		}
+
+		else free(code->protections[i]);
+	}
+
+	if (code->tcc && release)
+	{
+		Arena * previous = UseArena(code->arena);
+
+		tcc_delete(code->tcc);
+		UseArena(previous);
+		DestroyArena(code->arena);
+	}
+
+	free(code->protections);
+	FreeBlockList(&code->blocks);
+}
+
+//
+//
+//
+
+static void * CompileState (const char * source, const char * name, void * context, Code * code, Diagnostics * diags)
+{
+	// The state gets an arena of its own, so nothing else is charged for it.
+	// Once relocated, only its run memory is kept, and the rest thrown away.
+	bool keep_state = !CanKeepRunMemory();
+	Arena * arena = NewArena(), * previous = UseArena(arena);
+	TCCState * tcc = tcc_new();
+	BlockList run_blocks = { 0 };
+	void * func = NULL;
+
+	memset(code, 0, sizeof(Code));
+
+	if (tcc)
+	{
+		tcc_set_error_func(tcc, diags, CollectDiagnostic);
+		tcc_set_output_type(tcc, TCC_OUTPUT_MEMORY);
+		tcc_set_options(tcc, "-nostdlib");
+
+		tcc_add_symbol(tcc, "lua_touserdata", lua_touserdata);
+		tcc_add_symbol(tcc, "lua_toboolean", lua_toboolean);
+		tcc_add_symbol(tcc, "lua_isnumber", lua_isnumber);
+		tcc_add_symbol(tcc, "lua_tonumber", lua_tonumber);
+		tcc_add_symbol(tcc, "luaL_checknumber", luaL_checknumber);
+		tcc_add_symbol(tcc, "luaL_checklstring", luaL_checklstring);
+		tcc_add_symbol(tcc, "lua_pushnil", lua_pushnil);
+		tcc_add_symbol(tcc, "lua_pushnumber", lua_pushnumber);
+		tcc_add_symbol(tcc, "lua_pushboolean", lua_pushboolean);
+		tcc_add_symbol(tcc, "lua_pushstring", lua_pushstring);
+		tcc_add_symbol(tcc, "lua_pushlightuserdata", lua_pushlightuserdata);
+		tcc_add_symbol(tcc, "lua_rawgeti", lua_rawgeti);
+		tcc_add_symbol(tcc, "lua_rawseti", lua_rawseti);
+		tcc_add_symbol(tcc, "lua_settop", lua_settop);
+		tcc_add_symbol(tcc, "luaL_error", luaL_error);
+		tcc_add_symbol(tcc, "lua_gettop", lua_gettop);
+		tcc_add_symbol(tcc, "lua_checkstack", lua_checkstack);
+		tcc_add_symbol(tcc, "lua_call", lua_call);
+		tcc_add_symbol(tcc, "to_pointer", ToPointer);
+
+		if (context)
+		{
+			tcc_add_symbol(tcc, "context", context);
+			tcc_add_symbol(tcc, "this_thread", GetThreadMarker);
+			tcc_add_symbol(tcc, "wrong_thread", WrongThread);
+		}
+
+		if (0 == tcc_compile_string(tcc, source))
+		{
+			UseArena(NULL);
+			TrackSystemBlocks(&run_blocks);
+			BeginRunMemory(); // n.b. packed alongside modules' code
+
+			bool ok = 0 == tcc_relocate(tcc);
+
+			EndRunMemory(tcc, ok);
+			TrackSystemBlocks(NULL);
+			UseArena(arena);
+
+			if (ok) func = tcc_get_symbol(tcc, name);
+		}
+	}
+
+	if (func && keep_state)
+	{
+		code->tcc = tcc;
+		code->arena = arena;
+
+		arena = NULL;
+	}
+
+	else if (func)
+	{
+		KeepCode(tcc, &run_blocks, code);
+
+		if (0 == code->blocks.count) // n.b. nothing tracked, so nothing kept
+		{
+			ReleaseCode(code, false);
+
+			func = NULL;
+		}
+	}
+
+	else if (tcc) tcc_delete(tcc);
+
+	FreeBlockList(&run_blocks);
+	UseArena(previous);
+	DestroyArena(arena);
+
+	return func;
+}
+
+//
+//
+//
+
+static void * Compile (const char * source, const char * name, Diagnostics * diags)
+{
+	// Each thunk gets a state of its own, whose code is needed for good, so
+	// only the bookkeeping is dropped.
+	Code code;
+	void * func = CompileState(source, name, NULL, &code, diags);
+
+	if (func) ReleaseCode(&code, false);
+
+	return func;
+}
+
+//
+//
+//
+
+static const Thunk * GetCompiled (const char * signature, ThunkKind kind, const char * const ctypes[], int nctypes, Diagnostics * diags)
+{
+	char normalized[512], key[1024];
+	size_t len = strlen(signature);
+
+	if (len >= sizeof(normalized))
+	{
+		CollectDiagnostic(diags, "tcc: error: signature is too long");
+
+		return NULL;
+	}
+
+	Normalize(normalized, signature, signature + len);
+
+	if (nctypes > MAX_THUNK_ARGS + 1)
+	{
+		Reject("too many buffers for", NULL, normalized, diags);
+
+		return NULL;
+	}
+
+	strcpy(key, normalized);
+
+	for (int i = 0; i < nctypes; ++i)
+	{
+		strcat(key, i ? "," : "|"); // n.b. ample room, given the limits
+		strcat(key, ctypes[i]);
+	}
+
+	for (Thunk * thunk = sThunks; thunk; thunk = thunk->next)
+	{
+		if (thunk->kind == kind && strcmp(thunk->key, key) == 0) return thunk;
+	}
+
+	/* ----- */
+
+	const Type * types[MAX_THUNK_ARGS + 1];
+	int nargs;
+
+	if (!Parse(normalized, types, &nargs, diags)) return NULL;
+
+	if (kind != THUNK)
+	{
+		bool ok = nargs > 0 || Reject("no inputs in", NULL, normalized, diags);
+
+		if (ok && BUFFER_MAPPER == kind && nctypes != nargs + 1) ok = Reject("wrong number of buffers for", NULL, normalized, diags);
+
+		for (int i = 0; ok && i <= nargs; ++i)
+		{
+			if (types[i]->kind != KIND_NUMBER) ok = Reject("non-numeric type", types[i]->name, normalized, diags);
+		}
+
+		if (!ok) return NULL;
+	}
+
+	char source[8192];
+
+	static const char * names[] = { "thunk", "map", "map", "invoke" }; // n.b. as per ThunkKind
+
+	if (BUFFER_MAPPER == kind) GenerateBufferMapper(source, sizeof(source), types, nargs, ctypes);
+	else if (MAPPER == kind) GenerateMapper(source, sizeof(source), types, nargs);
+	else if (INVOKER == kind) GenerateInvoker(source, sizeof(source), types, nargs);
+	else Generate(source, sizeof(source), types, nargs);
+
+	void * func = Compile(source, names[kind], diags);
+
+	if (!func) return NULL;
+
+	/* ----- */
+
+	Thunk * thunk = malloc(sizeof(Thunk));
+
+	thunk->key = malloc(strlen(key) + 1);
+	thunk->func = func;
+	thunk->nargs = nargs;
+	thunk->kind = kind;
+
+	for (int i = 1; i <= nargs; ++i) thunk->kinds[i - 1] = KIND_NUMBER == types[i]->kind || KIND_BOOLEAN == types[i]->kind ? 'n' : 'p';
+
+	thunk->kinds[nargs] = '\0';
+	thunk->next = sThunks;
+
+	strcpy(thunk->key, key);
+
+	sThunks = thunk;
+
+	return thunk;
+}
+
+//
+//
+//
+
+lua_CFunction GetThunk (const char * signature, Diagnostics * diags)
+{
+	const Thunk * thunk = GetCompiled(signature, THUNK, NULL, 0, diags);
+
+	return thunk ? (lua_CFunction)thunk->func : NULL;
+}
+
+//
+//
+//
+
+Mapper GetMapper (const char * signature, int * nargs, Diagnostics * diags)
+{
+	const Thunk * thunk = GetCompiled(signature, MAPPER, NULL, 0, diags);
+
+	if (!thunk) return NULL;
+
+	*nargs = thunk->nargs;
+
+	return (Mapper)thunk->func;
+}
+
+//
+//
+//
+
+BufferMapper GetBufferMapper (const char * signature, const char * const ctypes[], int nctypes, Diagnostics * diags)
+{
+	const Thunk * thunk = GetCompiled(signature, BUFFER_MAPPER, ctypes, nctypes, diags);
+
+	return thunk ? (BufferMapper)thunk->func : NULL;
+}
+
+//
+//
+//
+
+Invoker GetInvoker (const char * signature, char kinds[MAX_THUNK_ARGS + 1], Diagnostics * diags)
+{
+	const Thunk * thunk = GetCompiled(signature, INVOKER, NULL, 0, diags);
+
+	if (!thunk) return NULL;
+
+	strcpy(kinds, thunk->kinds);
+
+	return (Invoker)thunk->func;
+}
+
+//
+//
+//
+
+struct Callback {
+	lua_State * L;
+	int ref;
+	const void * thread; // n.b. fields up to here are the generated code's context
+	Code code;
+	void * func;
+	Callback * next;
+};
+
+//
+//
+//
+
+Callback * NewCallback (lua_State * L, int ref, const char * signature, Callback * next, Diagnostics * diags)
+{
+	char normalized[512];
+	size_t len = strlen(signature);
+
+	if (len >= sizeof(normalized))
+	{
+		CollectDiagnostic(diags, "tcc: error: signature is too long");
+
+		return NULL;
+	}
+
+	Normalize(normalized, signature, signature + len);
+
+	const Type * types[MAX_THUNK_ARGS + 1];
+	int nargs;
+
+	if (!Parse(normalized, types, &nargs, diags)) return NULL;
+
+	// A string result would be gone along with the rest of the call's stack.
+	if (KIND_STRING == types[0]->kind)
+	{
+		Reject("unsupported return type", types[0]->name, normalized, diags);
+
+		return NULL;
+	}
+
+	/* ----- */
+
+	char source[8192];
+
+	GenerateCallback(source, sizeof(source), types, nargs);
+
+	Callback * callback = malloc(sizeof(Callback));
+
+	callback->L = L;
+	callback->ref = ref;
+	callback->thread = GetThreadMarker();
+	callback->func = CompileState(source, "callback", callback, &callback->code, diags);
+
+	if (!callback->func)
+	{
+		free(callback);
+
+		return NULL;
+	}
+
+	callback->next = next;
+
+	return callback;
+}
+
+//
+//
+//
+
+void * GetCallbackFunction (const Callback * callback)
+{
+	return callback->func;
+}
+
+//
+//
+//
+
+void FreeCallbacks (Callback * callback)
+{
+	while (callback)
+	{
+		Callback * next = callback->next;
+
+		luaL_unref(callback->L, LUA_REGISTRYINDEX, callback->ref);
+		ReleaseCode(&callback->code, true);
+		free(callback);
+
+		callback = next;
+	}
+}
@@ -0,0 +1,418 @@
+/*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*
+* [ MIT license: http://www.opensource.org/licenses/mit-license.php ]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "miniz.h"
+#include "pack.h"
+
+//
+//
+//
+
+#define MAX_MOUNTS 2
+
+//
+//
+//
+
+typedef struct {
+	const unsigned char * data;
+	const PackEntry * entries;
+	uint32_t count;
+	const char * prefix; // mount point, e.g. "library/"
+	size_t prefix_len;
+} Mount;
+
+//
+//
+//
+
+static Mount sMounts[MAX_MOUNTS];
+
+static int sMountCount;
+
+//
+//
+//
+
+void MountArchive (const unsigned char buf[], size_t size, const char * prefix)
+{
+	for (int i = 0; i < sMountCount; ++i)
+	{
+		if (sMounts[i].data == buf) return; // already mounted, e.g. on relaunch
+	}
+
+	if (MAX_MOUNTS == sMountCount) return;
+
+	/* ----- */
+
+	const PackHeader * header = (const PackHeader *)buf;
+
+	if (size < sizeof(PackHeader) || memcmp(header->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 || header->version != PACK_VERSION) return;
+
+	Mount * mount = &sMounts[sMountCount++];
+
+	mount->data = buf;
+	mount->entries = (const PackEntry *)(header + 1);
+	mount->count = header->count;
+	mount->prefix = prefix ? prefix : "";
+	mount->prefix_len = strlen(mount->prefix);
+}
+
+//
+//
+//
+
+static const char * GetName (const Mount * mount, const PackEntry * entry)
+{
+	return (const char *)mount->data + entry->name_offset;
+}
+
+//
+//
+//
+
+static bool IsCompressed (const PackEntry * entry)
+{
+	return entry->stored_size != entry->size;
+}
+
+//
+//
+//
+
+static Mount * FindFile (const char * name, const PackEntry ** entry)
+{
+	for (int i = 0; i < sMountCount; ++i)
+	{
+		Mount * mount = &sMounts[i];
+
+		if (strncmp(name, mount->prefix, mount->prefix_len) != 0) continue;
+
+		// The index is sorted by name at build time.
+		const char * key = name + mount->prefix_len;
+		uint32_t lo = 0, hi = mount->count;
+
+		while (lo < hi)
+		{
+			uint32_t mid = lo + (hi - lo) / 2;
+			int cmp = strcmp(key, GetName(mount, &mount->entries[mid]));
+
+			if (0 == cmp)
+			{
+				*entry = &mount->entries[mid];
+
+				return mount;
+			}
+
+			else if (cmp < 0) hi = mid;
+			else lo = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+//
+//
+//
+
+static void * Inflate (const Mount * mount, const PackEntry * entry)
+{
+	void * contents = malloc(entry->size ? entry->size : 1);
+
+	if (contents && tinfl_decompress_mem_to_mem(contents, entry->size, mount->data + entry->offset, entry->stored_size, 0) != entry->size)
+	{
+		free(contents);
+
+		contents = NULL;
+	}
+
+	return contents;
+}
+
+//
+//
+//
+
+static void NormalizeSeparators (char * path)
+{
+#ifdef WIN32
+	for (char * p = path; *p; ++p)
+	{
+		if ('/' == *p) *p = '\\';
+	}
+#else
+	(void)path;
+#endif
+}
+
+//
+//
+//
+
+static bool WriteFile (const char * path, const void * contents, size_t size)
+{
+	FILE * fp = fopen(path, "wb");
+
+	if (!fp) return false;
+
+	setvbuf(fp, NULL, _IONBF, 0); // contents are already in one piece, so write them in one go
+
+	bool ok = fwrite(contents, 1, size, fp) == size;
+
+	return fclose(fp) == 0 && ok;
+}
+
+//
+//
+//
+
+static bool MaterializeEntry (const Mount * mount, const PackEntry * entry, const char * path)
+{
+	if (!IsCompressed(entry)) return WriteFile(path, mount->data + entry->offset, entry->size);
+
+	/* ----- */
+
+	// Only TinyCC consumes these, e.g. large libraries, so nothing is kept.
+	void * contents = Inflate(mount, entry);
+
+	if (!contents) return false;
+
+	bool ok = WriteFile(path, contents, entry->size);
+
+	free(contents);
+
+	return ok;
+}
+
+//
+//
+//
+
+bool MaterializeVirtualFile (const char * name, const char * as)
+{
+	const PackEntry * entry;
+	Mount * mount = FindFile(name, &entry);
+
+	if (!mount) return false;
+
+	char path[PATH_MAX];
+
+	strcpy(path, GetFileInTempDir(as ? as : name));
+	NormalizeSeparators(path);
+
+	return MaterializeEntry(mount, entry, path);
+}
+
+//
+//
+//
+
+typedef struct {
+	const Mount * mount;
+	const PackEntry * entry;
+	char name[PATH_MAX];
+	char path[PATH_MAX];
+} Entry;
+
+typedef struct {
+	Entry * entries;
+	int count, next;
+	Mutex * mutex;
+} EntryList;
+
+//
+//
+//
+
+static int CompareEntries (const void * a, const void * b)
+{
+	const Entry * ea = a, * eb = b;
+	uint32_t wa = ea->entry->stored_size + (IsCompressed(ea->entry) ? ea->entry->size : 0);
+	uint32_t wb = eb->entry->stored_size + (IsCompressed(eb->entry) ? eb->entry->size : 0);
+
+	// Costliest first, so the long inflates and writes are not left for the end.
+	if (wa != wb) return wa < wb ? +1 : -1;
+	else return 0;
+}
+
+//
+//
+//
+
+static int CompareNames (const void * a, const void * b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+//
+//
+//
+
+static void MakeDirectories (const EntryList * list)
+{
+	// Gather every directory any entry needs; once sorted, parents come
+	// before their children and duplicates are adjacent, so each one is
+	// created exactly once and in a valid order.
+	int capacity = 16, count = 0;
+	char ** dirs = malloc(capacity * sizeof(char *));
+
+	for (int i = 0; i < list->count; ++i)
+	{
+		const char * name = list->entries[i].name;
+
+		for (const char * sep = strchr(name, '/'); sep; sep = strchr(sep + 1, '/'))
+		{
+			if (count == capacity) dirs = realloc(dirs, (capacity *= 2) * sizeof(char *));
+
+			size_t len = sep - name;
+
+			dirs[count] = malloc(len + 1);
+
+			memcpy(dirs[count], name, len);
+
+			dirs[count++][len] = '\0';
+		}
+	}
+
+	qsort(dirs, count, sizeof(char *), CompareNames);
+
+	/* ----- */
+
+	char path[PATH_MAX];
+
+	for (int i = 0; i < count; ++i)
+	{
+		if (0 == i || strcmp(dirs[i - 1], dirs[i]) != 0)
+		{
+			strcpy(path, GetFileInTempDir(dirs[i]));
+			NormalizeSeparators(path);
+			MakeDirectory(path);
+		}
+	}
+
+	for (int i = 0; i < count; ++i) free(dirs[i]);
+
+	free(dirs);
+}
+
+//
+//
+//
+
+static void ExtractEntries (void * ud)
+{
+	EntryList * list = ud;
+
+	for (;;)
+	{
+		LockMutex(list->mutex);
+
+		int i = list->next++;
+
+		UnlockMutex(list->mutex);
+
+		if (i >= list->count) break;
+
+		/* ----- */
+
+		const Entry * entry = &list->entries[i];
+
+		MaterializeEntry(entry->mount, entry->entry, entry->path);
+	}
+}
+
+//
+//
+//
+
+#define MAX_EXTRACTION_THREADS 8
+
+//
+//
+//
+
+// libtcc opens headers and libraries itself, through open() on its search paths,
+// so there is no point at which an #include could be served from the mounts.
+// The whole tree, less whatever should_ignore() rejects, is therefore written
+// out ahead of the first compile; every directory an entry needs, including
+// the mount points themselves, is created first by MakeDirectories().
+void MaterializeVirtualFiles (bool (*should_ignore)(const char * name))
+{
+	EntryList list = { 0 };
+	uint32_t capacity = 0;
+
+	for (int i = 0; i < sMountCount; ++i) capacity += sMounts[i].count;
+
+	list.entries = malloc((capacity ? capacity : 1) * sizeof(Entry));
+
+	/* ----- */
+
+	for (int i = 0; i < sMountCount; ++i)
+	{
+		const Mount * mount = &sMounts[i];
+
+		for (uint32_t j = 0; j < mount->count; ++j)
+		{
+			Entry * entry = &list.entries[list.count];
+			const char * name = GetName(mount, &mount->entries[j]);
+
+			if (mount->prefix_len + strlen(name) >= PATH_MAX) continue;
+
+			strcpy(entry->name, mount->prefix);
+			strcat(entry->name, name);
+
+			if (should_ignore(entry->name)) continue;
+
+			strcpy(entry->path, GetFileInTempDir(entry->name)); // n.b. resolved up front, since the workers can't share the buffer
+			NormalizeSeparators(entry->path);
+
+			entry->mount = mount;
+			entry->entry = &mount->entries[j];
+
+			++list.count;
+		}
+	}
+
+	/* ----- */
+
+	MakeDirectories(&list);
+
+	qsort(list.entries, list.count, sizeof(Entry), CompareEntries);
+
+	int nthreads = GetCoreCount();
+
+	if (nthreads > MAX_EXTRACTION_THREADS) nthreads = MAX_EXTRACTION_THREADS;
+	if (nthreads > list.count) nthreads = list.count;
+
+	list.mutex = NewMutex();
+
+	RunInParallel(nthreads, ExtractEntries, &list);
+
+	DestroyMutex(list.mutex);
+	free(list.entries);
+}
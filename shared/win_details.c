@@ -22,7 +22,11 @@
 */
 
 #ifdef WIN32
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "common.h"
 #include "miniz.h"
@@ -31,11 +35,209 @@
 
 void FixLib(void)
 {
-	const char* old_name = "libtcc_win32.a";
-	char old_buf[PATH_MAX];
+	MaterializeVirtualFile("libtcc_win32.a", "libtcc1.a");
+}
+
+void MakeDirectory(const char* filename)
+{
+	_mkdir(filename);
+}
+
+struct Mutex {
+	CRITICAL_SECTION cs;
+};
+
+struct Condition {
+	CONDITION_VARIABLE cv;
+};
+
+struct Thread {
+	HANDLE handle;
+	void (*func)(void* ud);
+	void* ud;
+};
+
+Mutex* NewMutex(void)
+{
+	Mutex* mutex = malloc(sizeof(Mutex));
+
+	InitializeCriticalSection(&mutex->cs);
+
+	return mutex;
+}
+
+void LockMutex(Mutex* mutex)
+{
+	EnterCriticalSection(&mutex->cs);
+}
+
+void UnlockMutex(Mutex* mutex)
+{
+	LeaveCriticalSection(&mutex->cs);
+}
+
+void DestroyMutex(Mutex* mutex)
+{
+	DeleteCriticalSection(&mutex->cs);
+	free(mutex);
+}
+
+Condition* NewCondition(void)
+{
+	Condition* condition = malloc(sizeof(Condition));
+
+	InitializeConditionVariable(&condition->cv);
+
+	return condition;
+}
+
+void WaitCondition(Condition* condition, Mutex* mutex)
+{
+	SleepConditionVariableCS(&condition->cv, &mutex->cs, INFINITE);
+}
+
+void BroadcastCondition(Condition* condition)
+{
+	WakeAllConditionVariable(&condition->cv);
+}
+
+void DestroyCondition(Condition* condition)
+{
+	free(condition); // n.b. condition variables need no cleanup
+}
+
+static unsigned __stdcall ThreadBody(void* ud)
+{
+	Thread* thread = ud;
+
+	thread->func(thread->ud);
+
+	return 0;
+}
+
+Thread* NewThread(void (*func)(void* ud), void* ud)
+{
+	Thread* thread = malloc(sizeof(Thread));
+
+	thread->func = func;
+	thread->ud = ud;
+	thread->handle = (HANDLE)_beginthreadex(NULL, 0, ThreadBody, thread, 0, NULL);
+
+	if (!thread->handle)
+	{
+		free(thread);
+
+		return NULL;
+	}
+
+	return thread;
+}
+
+void JoinThread(Thread* thread)
+{
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+	free(thread);
+}
+
+int GetCoreCount(void)
+{
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+
+	return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+size_t GetPageSize(void)
+{
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+
+	return info.dwPageSize;
+}
+
+void* MapPages(size_t size)
+{
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+void UnmapPages(void* pages, size_t size)
+{
+	(void)size;
+
+	VirtualFree(pages, 0, MEM_RELEASE);
+}
+
+void AllowCodeWrites(bool allow)
+{
+	(void)allow; // n.b. protections alone decide this
+}
+
+typedef struct {
+	char* start;
+	SIZE_T size;
+	DWORD protection;
+} Range;
+
+struct PageProtection {
+	int count;
+	Range ranges[1]; // variable-length
+};
+
+PageProtection* SaveProtection(const void* ptr, size_t size)
+{
+	char* start = (char*)((UINT_PTR)ptr & ~(UINT_PTR)(GetPageSize() - 1)), * end = (char*)ptr + size;
+	PageProtection* pp = malloc(sizeof(PageProtection));
+	int capacity = 1;
+
+	pp->count = 0;
+
+	for (char* addr = start; addr < end; )
+	{
+		MEMORY_BASIC_INFORMATION mbi;
+
+		if (!VirtualQuery(addr, &mbi, sizeof(mbi))) break;
+
+		char* region_end = (char*)mbi.BaseAddress + mbi.RegionSize;
+
+		if (pp->count == capacity) pp = realloc(pp, sizeof(PageProtection) + (capacity *= 2) * sizeof(Range));
+
+		Range* range = &pp->ranges[pp->count++];
+
+		range->start = addr;
+		range->size = (region_end > end ? end : region_end) - addr;
+		range->protection = mbi.Protect;
+
+		addr += range->size;
+	}
+
+	return pp;
+}
+
+void ApplyProtection(const PageProtection* pp)
+{
+	for (int i = 0; i < pp->count; ++i)
+	{
+		DWORD old;
+
+		VirtualProtect(pp->ranges[i].start, pp->ranges[i].size, pp->ranges[i].protection, &old);
+
+		if (pp->ranges[i].protection & (PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE)) FlushInstructionCache(GetCurrentProcess(), pp->ranges[i].start, pp->ranges[i].size);
+	}
+}
+
+void ResetProtection(PageProtection* pp)
+{
+	for (int i = 0; i < pp->count; ++i)
+	{
+		DWORD old;
+
+		VirtualProtect(pp->ranges[i].start, pp->ranges[i].size, PAGE_READWRITE, &old);
+	}
 
-	strcpy(old_buf, GetFileInTempDir(old_name));
-	rename(old_buf, GetFileInTempDir("libtcc1.a"));
+	free(pp);
 }
 
 void SetUpPaths(lua_State* L, Paths* paths)